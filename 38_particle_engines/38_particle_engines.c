@@ -6,12 +6,38 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <time.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 
 #define MOVING_OBJECT_WIDTH 64
 #define MOVING_OBJECT_HEIGHT 64
 #define MOVING_OBJECT_MAX_VELOCITY 10
 #define TOTAL_PARTICLES 20
+// particles die after this frame
+#define PART_LIFETIME 10
+// red, green and yellow particles
+#define TOTAL_PART_TYPES 3
+// particles processed at once by the kernels, pools are padded to it
+#define PART_LANES 8
+// particles of an emitter updated by one job, a multiple of PART_LANES
+#define PART_BLOCK_SIZE 16384
+// particles spawned with a batch of random numbers
+#define PART_SPAWN_BATCH 256
+// random numbers drawn per spawned particle
+#define PART_RANDOMS 3
+// particles of every texture are drawn at once, the white shimmer last
+#define PART_SHIMMER TOTAL_PART_TYPES
+#define TOTAL_PART_BATCHES (TOTAL_PART_TYPES + 1)
+#define PART_ALPHA 192
+
+// Benchmark constants
+#define BENCH_PARTICLES 1000000
+
+// Worker threads constants
+#define MAX_WORKERS 16
 
 struct l_texture {
 	SDL_Texture *texture;
@@ -19,19 +45,79 @@ struct l_texture {
 	int height;
 };
 
+// xoshiro128** generators, one per lane, stored by state word for the
+// kernels to step PART_LANES of them at once
+struct l_rng {
+	uint32_t s[4][PART_LANES];
+};
+
+// particles pool, allocated once when the emitter is created, with an array
+// per particle field for the kernels to go through PART_LANES particles at
+// once. The pool is split in blocks of PART_BLOCK_SIZE particles updated
+// independently, alive particles being kept at the start of their block.
+// Each block spawns its particles from its own random numbers
+struct l_emitter {
+	void *pool;
+	float *pos_x;
+	float *pos_y;
+	float *vel_x;
+	float *vel_y;
+	int32_t *frame; // current frame
+	uint8_t *type;
+	int *counts; // alive particles of each block
+	struct l_rng *rngs; // random numbers of each block
+	int spawn_x;
+	int spawn_y;
+	int nb_blocks;
+	int nb_particles;
+	int size;
+};
+
+struct l_worker {
+	struct l_workers *workers;
+	SDL_Thread *thread;
+	// index given to jobs, to pick per thread memory
+	int index;
+};
+
+// threads running batches of jobs with the thread submitting them, which is
+// the worker of index nb_workers
+struct l_workers {
+	struct l_worker workers[MAX_WORKERS];
+	int nb_workers;
+	SDL_mutex *lock;
+	SDL_cond *work_cond;
+	SDL_cond *done_cond;
+	// current batch, index of its next job to run and jobs done
+	void (*func)(void *data, int job, int worker);
+	void *data;
+	int nb_jobs;
+	int next;
+	int nb_done;
+	int quit;
+};
+
+// quads of the particles drawn with one texture
+struct l_part_batch {
+	SDL_Vertex *vertices;
+	int nb_quads;
+	int size;
+};
+
+// particles update kernels, for a given instruction set
+struct l_part_kernel {
+	char *name;
+	void (*update)(struct l_emitter *e, int first, int last);
+	unsigned (*dead_mask)(int32_t *frame);
+	void (*random)(struct l_rng *rng, uint32_t *out, int n);
+};
+
 struct l_moving_object {
 	int pos_x;
 	int pos_y;
 	int vel_x;
 	int vel_y;
-	struct l_particle *particles[TOTAL_PARTICLES];
-};
-
-struct l_particle {
-	int pos_x;
-	int pos_y;
-	int frame; // current frame
-	struct l_texture *t;
+	struct l_emitter emitter;
 };
 
 #define PATH_TO_LION "../medias/lion_head.png"
@@ -50,6 +136,15 @@ struct l_texture part_red_texture;
 struct l_texture part_green_texture;
 struct l_texture part_yellow_texture;
 struct l_texture part_white_texture;
+struct l_texture *part_textures[TOTAL_PART_TYPES] = {
+	&part_red_texture, &part_green_texture, &part_yellow_texture
+};
+// kernels the particles are updated with
+struct l_part_kernel *part_kernel;
+// quads of all the emitters, by texture, and their indices
+struct l_part_batch part_batches[TOTAL_PART_BATCHES];
+int *part_indices;
+int part_indices_size;
 
 const int SCREEN_WIDTH = 640;
 const int SCREEN_HEIGHT = 400;
@@ -58,50 +153,666 @@ const int SCREEN_HEIGHT = 400;
 // static declarations
 ///////////////////////////////////////////////////////
 static void texture_render(struct l_texture *t, int x, int y);
+static struct l_texture *part_batch_texture(int batch);
 
 ///////////////////////////////////////////////////////
 // particles functions
 ///////////////////////////////////////////////////////
 
-static void part_init(struct l_particle *p, int x, int y)
+// r holds PART_RANDOMS random numbers
+static void part_init(struct l_emitter *e, int i, int x, int y, uint32_t *r)
 {
-	// set position offset
-	p->pos_x = x - 25 + (rand() % 25);
-	p->pos_y = y - 25 + (rand() % 25);
+	// set position offset and a slow drift
+	e->pos_x[i] = x - 25 + (int)((r[0] & 0xFFFF) % 25);
+	e->pos_y[i] = y - 25 + (int)((r[0] >> 16) % 25);
+	e->vel_x[i] = ((int)((r[1] & 0xFFFF) % 65) - 32) / 64.0f;
+	e->vel_y[i] = ((int)((r[1] >> 16) % 65) - 32) / 64.0f;
 
 	// initilialize animation
-	p->frame = rand() % 5;
+	e->frame[i] = (r[2] & 0xFFFF) % 5;
 
 	// set type
-	switch (rand() % 3) {
-	case 0:
-		p->t = &part_red_texture;
-		break;
-	case 1:
-		p->t = &part_green_texture;
-		break;
-	case 2:
-		p->t = &part_yellow_texture;
-		break;
+	e->type[i] = (r[2] >> 16) % TOTAL_PART_TYPES;
+}
+
+static inline void part_move(struct l_emitter *e, int to, int from)
+{
+	e->pos_x[to] = e->pos_x[from];
+	e->pos_y[to] = e->pos_y[from];
+	e->vel_x[to] = e->vel_x[from];
+	e->vel_y[to] = e->vel_y[from];
+	e->frame[to] = e->frame[from];
+	e->type[to] = e->type[from];
+}
+
+///////////////////////////////////////////////////////
+// particles kernels functions
+///////////////////////////////////////////////////////
+
+// update kernels move and age the particles from first, a multiple of
+// PART_LANES, up to last rounded up to PART_LANES. Dead mask kernels return
+// a bit per dead particle of the PART_LANES ones from frame. Random kernels
+// draw n numbers, a multiple of PART_LANES, a number of each lane in turn
+
+static void part_update_scalar(struct l_emitter *e, int first, int last)
+{
+	for (int i = first; i < last; i++) {
+		e->pos_x[i] += e->vel_x[i];
+		e->pos_y[i] += e->vel_y[i];
+		e->frame[i]++;
+	}
+}
+
+static unsigned part_dead_mask_scalar(int32_t *frame)
+{
+	unsigned mask = 0;
+
+	for (int i = 0; i < PART_LANES; i++)
+		mask |= (frame[i] > PART_LIFETIME) << i;
+	return mask;
+}
+
+static inline uint32_t rotl32(uint32_t x, int k)
+{
+	return x << k | x >> (32 - k);
+}
+
+static void part_random_scalar(struct l_rng *rng, uint32_t *out, int n)
+{
+	for (int k = 0; k < n; k += PART_LANES) {
+		for (int l = 0; l < PART_LANES; l++) {
+			uint32_t *s0 = &rng->s[0][l], *s1 = &rng->s[1][l];
+			uint32_t *s2 = &rng->s[2][l], *s3 = &rng->s[3][l];
+			uint32_t t = *s1 << 9;
+
+			out[k + l] = rotl32(*s1 * 5, 7) * 9;
+			*s2 ^= *s0;
+			*s3 ^= *s1;
+			*s1 ^= *s2;
+			*s0 ^= *s3;
+			*s2 ^= t;
+			*s3 = rotl32(*s3, 11);
+		}
+	}
+}
+
+#ifdef __SSE2__
+static void part_update_sse2(struct l_emitter *e, int first, int last)
+{
+	__m128i one = _mm_set1_epi32(1);
+
+	for (int i = first; i < last; i += 4) {
+		__m128 x = _mm_load_ps(&e->pos_x[i]);
+		__m128 y = _mm_load_ps(&e->pos_y[i]);
+		__m128i frame = _mm_load_si128((__m128i *)&e->frame[i]);
+
+		x = _mm_add_ps(x, _mm_load_ps(&e->vel_x[i]));
+		y = _mm_add_ps(y, _mm_load_ps(&e->vel_y[i]));
+		_mm_store_ps(&e->pos_x[i], x);
+		_mm_store_ps(&e->pos_y[i], y);
+		_mm_store_si128((__m128i *)&e->frame[i],
+				_mm_add_epi32(frame, one));
+	}
+}
+
+static unsigned part_dead_mask_sse2(int32_t *frame)
+{
+	__m128i lifetime = _mm_set1_epi32(PART_LIFETIME);
+	__m128i lo = _mm_cmpgt_epi32(_mm_load_si128((__m128i *)frame),
+				     lifetime);
+	__m128i hi = _mm_cmpgt_epi32(_mm_load_si128((__m128i *)&frame[4]),
+				     lifetime);
+
+	return _mm_movemask_ps(_mm_castsi128_ps(lo)) |
+	       _mm_movemask_ps(_mm_castsi128_ps(hi)) << 4;
+}
+
+#define ROTL_SSE2(x, k) _mm_or_si128(_mm_slli_epi32(x, k), _mm_srli_epi32(x, 32 - (k)))
+
+// multiplies by 5 and 9 are shifts and adds, SSE2 has no 32 bit multiply
+static void part_random_sse2(struct l_rng *rng, uint32_t *out, int n)
+{
+	for (int h = 0; h < PART_LANES; h += 4) {
+		__m128i s0 = _mm_load_si128((__m128i *)&rng->s[0][h]);
+		__m128i s1 = _mm_load_si128((__m128i *)&rng->s[1][h]);
+		__m128i s2 = _mm_load_si128((__m128i *)&rng->s[2][h]);
+		__m128i s3 = _mm_load_si128((__m128i *)&rng->s[3][h]);
+
+		for (int k = 0; k < n; k += PART_LANES) {
+			__m128i r = _mm_add_epi32(_mm_slli_epi32(s1, 2), s1);
+			__m128i t = _mm_slli_epi32(s1, 9);
+
+			r = ROTL_SSE2(r, 7);
+			r = _mm_add_epi32(_mm_slli_epi32(r, 3), r);
+			_mm_storeu_si128((__m128i *)&out[k + h], r);
+			s2 = _mm_xor_si128(s2, s0);
+			s3 = _mm_xor_si128(s3, s1);
+			s1 = _mm_xor_si128(s1, s2);
+			s0 = _mm_xor_si128(s0, s3);
+			s2 = _mm_xor_si128(s2, t);
+			s3 = ROTL_SSE2(s3, 11);
+		}
+
+		_mm_store_si128((__m128i *)&rng->s[0][h], s0);
+		_mm_store_si128((__m128i *)&rng->s[1][h], s1);
+		_mm_store_si128((__m128i *)&rng->s[2][h], s2);
+		_mm_store_si128((__m128i *)&rng->s[3][h], s3);
+	}
+}
+
+__attribute__((target("avx2"))) static void
+part_update_avx2(struct l_emitter *e, int first, int last)
+{
+	__m256i one = _mm256_set1_epi32(1);
+
+	for (int i = first; i < last; i += 8) {
+		__m256 x = _mm256_load_ps(&e->pos_x[i]);
+		__m256 y = _mm256_load_ps(&e->pos_y[i]);
+		__m256i frame = _mm256_load_si256((__m256i *)&e->frame[i]);
+
+		x = _mm256_add_ps(x, _mm256_load_ps(&e->vel_x[i]));
+		y = _mm256_add_ps(y, _mm256_load_ps(&e->vel_y[i]));
+		_mm256_store_ps(&e->pos_x[i], x);
+		_mm256_store_ps(&e->pos_y[i], y);
+		_mm256_store_si256((__m256i *)&e->frame[i],
+				   _mm256_add_epi32(frame, one));
+	}
+}
+
+__attribute__((target("avx2"))) static unsigned
+part_dead_mask_avx2(int32_t *frame)
+{
+	__m256i dead = _mm256_cmpgt_epi32(
+		_mm256_load_si256((__m256i *)frame),
+		_mm256_set1_epi32(PART_LIFETIME));
+
+	return _mm256_movemask_ps(_mm256_castsi256_ps(dead));
+}
+
+#define ROTL_AVX2(x, k) \
+	_mm256_or_si256(_mm256_slli_epi32(x, k), _mm256_srli_epi32(x, 32 - (k)))
+
+__attribute__((target("avx2"))) static void
+part_random_avx2(struct l_rng *rng, uint32_t *out, int n)
+{
+	__m256i s0 = _mm256_load_si256((__m256i *)rng->s[0]);
+	__m256i s1 = _mm256_load_si256((__m256i *)rng->s[1]);
+	__m256i s2 = _mm256_load_si256((__m256i *)rng->s[2]);
+	__m256i s3 = _mm256_load_si256((__m256i *)rng->s[3]);
+
+	for (int k = 0; k < n; k += PART_LANES) {
+		__m256i r = _mm256_add_epi32(_mm256_slli_epi32(s1, 2), s1);
+		__m256i t = _mm256_slli_epi32(s1, 9);
+
+		r = ROTL_AVX2(r, 7);
+		r = _mm256_add_epi32(_mm256_slli_epi32(r, 3), r);
+		_mm256_storeu_si256((__m256i *)&out[k], r);
+		s2 = _mm256_xor_si256(s2, s0);
+		s3 = _mm256_xor_si256(s3, s1);
+		s1 = _mm256_xor_si256(s1, s2);
+		s0 = _mm256_xor_si256(s0, s3);
+		s2 = _mm256_xor_si256(s2, t);
+		s3 = ROTL_AVX2(s3, 11);
+	}
+
+	_mm256_store_si256((__m256i *)rng->s[0], s0);
+	_mm256_store_si256((__m256i *)rng->s[1], s1);
+	_mm256_store_si256((__m256i *)rng->s[2], s2);
+	_mm256_store_si256((__m256i *)rng->s[3], s3);
+}
+#endif
+
+struct l_part_kernel part_kernels[] = {
+	{ "scalar", part_update_scalar, part_dead_mask_scalar,
+	  part_random_scalar },
+#ifdef __SSE2__
+	{ "sse2", part_update_sse2, part_dead_mask_sse2, part_random_sse2 },
+	{ "avx2", part_update_avx2, part_dead_mask_avx2, part_random_avx2 },
+#endif
+};
+
+#define TOTAL_PART_KERNELS \
+	((int)(sizeof(part_kernels) / sizeof(part_kernels[0])))
+
+static int part_kernel_supported(struct l_part_kernel *k)
+{
+#ifdef __SSE2__
+	if (!strcmp(k->name, "avx2"))
+		return __builtin_cpu_supports("avx2");
+#endif
+	return 1;
+}
+
+// the given kernel, or the widest one the cpu supports
+static struct l_part_kernel *part_kernel_select(char *name)
+{
+	struct l_part_kernel *best = NULL;
+
+	for (int i = 0; i < TOTAL_PART_KERNELS; i++) {
+		struct l_part_kernel *k = &part_kernels[i];
+
+		if (!part_kernel_supported(k))
+			continue;
+		if (name && !strcmp(k->name, name))
+			return k;
+		best = k;
+	}
+
+	return name ? NULL : best;
+}
+
+///////////////////////////////////////////////////////
+// worker threads functions
+///////////////////////////////////////////////////////
+
+static void workers_work(struct l_workers *workers, int index)
+{
+	SDL_LockMutex(workers->lock);
+	while (workers->next < workers->nb_jobs) {
+		int job = workers->next++;
+
+		SDL_UnlockMutex(workers->lock);
+		workers->func(workers->data, job, index);
+		SDL_LockMutex(workers->lock);
+
+		if (++workers->nb_done == workers->nb_jobs)
+			SDL_CondSignal(workers->done_cond);
 	}
+	SDL_UnlockMutex(workers->lock);
 }
 
-static void part_render(struct l_particle *p)
+static int worker_thread(void *data)
 {
-	// show image
-	texture_render(p->t, p->pos_x, p->pos_y);
+	struct l_worker *worker = data;
+	struct l_workers *workers = worker->workers;
+
+	SDL_LockMutex(workers->lock);
+	while (!workers->quit) {
+		if (workers->next >= workers->nb_jobs) {
+			SDL_CondWait(workers->work_cond, workers->lock);
+			continue;
+		}
+		SDL_UnlockMutex(workers->lock);
+		workers_work(workers, worker->index);
+		SDL_LockMutex(workers->lock);
+	}
+	SDL_UnlockMutex(workers->lock);
 
-	// show shimmer / white
-	if (p->frame % 2 == 0)
-		texture_render(&part_white_texture, p->pos_x, p->pos_y);
+	return 0;
+}
 
-	// animate
-	p->frame++;
+// run func for every job of a batch on the worker threads and the calling
+// one, returning once all jobs are done. worker is below nb_workers + 1.
+static void workers_run(struct l_workers *workers,
+			void (*func)(void *data, int job, int worker),
+			void *data, int nb_jobs)
+{
+	if (nb_jobs <= 0)
+		return;
+
+	// not worth waking the workers up
+	if (nb_jobs == 1 || !workers->nb_workers) {
+		for (int i = 0; i < nb_jobs; i++)
+			func(data, i, workers->nb_workers);
+		return;
+	}
+
+	SDL_LockMutex(workers->lock);
+	workers->func = func;
+	workers->data = data;
+	workers->nb_jobs = nb_jobs;
+	workers->next = 0;
+	workers->nb_done = 0;
+	SDL_CondBroadcast(workers->work_cond);
+	SDL_UnlockMutex(workers->lock);
+
+	workers_work(workers, workers->nb_workers);
+
+	SDL_LockMutex(workers->lock);
+	while (workers->nb_done < workers->nb_jobs)
+		SDL_CondWait(workers->done_cond, workers->lock);
+	workers->nb_jobs = 0;
+	workers->next = 0;
+	SDL_UnlockMutex(workers->lock);
 }
 
-static int part_is_dead(struct l_particle *p)
+static void workers_free(struct l_workers *workers)
 {
-	return p->frame > 10 ? 1 : 0;
+	if (workers->lock) {
+		SDL_LockMutex(workers->lock);
+		workers->quit = 1;
+		SDL_CondBroadcast(workers->work_cond);
+		SDL_UnlockMutex(workers->lock);
+	}
+	for (int i = 0; i < workers->nb_workers; i++)
+		if (workers->workers[i].thread)
+			SDL_WaitThread(workers->workers[i].thread, NULL);
+
+	if (workers->done_cond)
+		SDL_DestroyCond(workers->done_cond);
+	if (workers->work_cond)
+		SDL_DestroyCond(workers->work_cond);
+	if (workers->lock)
+		SDL_DestroyMutex(workers->lock);
+	memset(workers, 0, sizeof(*workers));
+}
+
+// nb_workers threads beside the calling one
+static int workers_init(struct l_workers *workers, int nb_workers)
+{
+	memset(workers, 0, sizeof(*workers));
+	workers->lock = SDL_CreateMutex();
+	workers->work_cond = SDL_CreateCond();
+	workers->done_cond = SDL_CreateCond();
+	if (!workers->lock || !workers->work_cond || !workers->done_cond) {
+		printf("Failed to create workers locks! SDL Error: %s\n",
+		       SDL_GetError());
+		workers_free(workers);
+		return -ENOMEM;
+	}
+
+	for (int i = 0; i < nb_workers; i++) {
+		struct l_worker *worker = &workers->workers[i];
+
+		worker->workers = workers;
+		worker->index = i;
+		worker->thread = SDL_CreateThread(worker_thread, "worker",
+						  worker);
+		if (!worker->thread) {
+			printf("Failed to create worker! SDL Error: %s\n",
+			       SDL_GetError());
+			workers_free(workers);
+			return -ENOMEM;
+		}
+		workers->nb_workers++;
+	}
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////
+// emitter functions
+///////////////////////////////////////////////////////
+
+// splitmix64, to seed the generators
+static uint64_t rng_seed_next(uint64_t *state)
+{
+	uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+	return z ^ (z >> 31);
+}
+
+// a generator per lane of every block, only depending on the emitter seed
+// and their position
+static void emitter_seed(struct l_emitter *e, uint32_t seed)
+{
+	for (int b = 0; b < e->nb_blocks; b++) {
+		for (int l = 0; l < PART_LANES; l++) {
+			uint64_t state = (uint64_t)seed << 32 |
+					 (uint32_t)(b * PART_LANES + l);
+
+			for (int w = 0; w < 4; w += 2) {
+				uint64_t z = rng_seed_next(&state);
+
+				e->rngs[b].s[w][l] = z;
+				e->rngs[b].s[w + 1][l] = z >> 32;
+			}
+		}
+	}
+}
+
+static int emitter_init(struct l_emitter *e, int size, uint32_t seed)
+{
+	// kernels go through whole lanes past the last particle
+	size_t padded = (size + PART_LANES - 1) / PART_LANES * PART_LANES;
+	size_t align = PART_LANES * sizeof(float);
+	size_t bytes = padded * (4 * sizeof(float) + sizeof(int32_t) + 1);
+	uint8_t *p;
+
+	e->nb_blocks = (size + PART_BLOCK_SIZE - 1) / PART_BLOCK_SIZE;
+	e->counts = calloc(e->nb_blocks, sizeof(*e->counts));
+	// the size of an aligned allocation is a multiple of its alignment
+	e->pool = aligned_alloc(align, (bytes + align - 1) / align * align);
+	e->rngs = aligned_alloc(align, e->nb_blocks * sizeof(*e->rngs));
+	if (!e->pool || !e->counts || !e->rngs) {
+		printf("Failed to alloc %d particles!\n", size);
+		free(e->pool);
+		free(e->counts);
+		free(e->rngs);
+		return -ENOMEM;
+	}
+	memset(e->pool, 0, bytes);
+	emitter_seed(e, seed);
+
+	p = e->pool;
+	e->pos_x = (float *)p;
+	e->pos_y = (float *)(p += padded * sizeof(float));
+	e->vel_x = (float *)(p += padded * sizeof(float));
+	e->vel_y = (float *)(p += padded * sizeof(float));
+	e->frame = (int32_t *)(p += padded * sizeof(float));
+	e->type = p + padded * sizeof(int32_t);
+	e->nb_particles = 0;
+	e->size = size;
+
+	return 0;
+}
+
+static void emitter_free(struct l_emitter *e)
+{
+	free(e->pool);
+	free(e->counts);
+	free(e->rngs);
+	e->pool = NULL;
+	e->counts = NULL;
+	e->rngs = NULL;
+	e->nb_blocks = 0;
+	e->nb_particles = 0;
+	e->size = 0;
+}
+
+static inline int emitter_block_size(struct l_emitter *e, int block)
+{
+	return SDL_min(PART_BLOCK_SIZE, e->size - block * PART_BLOCK_SIZE);
+}
+
+// replace dead particles by the last alive ones, lanes without any dead
+// particle are skipped at once, return the number of particles left
+static int emitter_kill(struct l_emitter *e, int first, int last)
+{
+	int i = first;
+
+	while (i < last) {
+		int end;
+
+		if (!part_kernel->dead_mask(&e->frame[i]) &&
+		    i + PART_LANES <= last) {
+			i += PART_LANES;
+			continue;
+		}
+
+		end = i + PART_LANES;
+		while (i < SDL_min(end, last)) {
+			if (e->frame[i] > PART_LIFETIME)
+				part_move(e, i, --last);
+			else
+				i++;
+		}
+	}
+
+	return last - first;
+}
+
+// fill a block with new particles, drawing their random numbers by batches
+static void emitter_spawn(struct l_emitter *e, int block)
+{
+	uint32_t r[PART_RANDOMS * PART_SPAWN_BATCH];
+	int first = block * PART_BLOCK_SIZE;
+	int size = emitter_block_size(e, block);
+
+	while (e->counts[block] < size) {
+		int n = SDL_min(size - e->counts[block], PART_SPAWN_BATCH);
+
+		// whole lanes of numbers are drawn
+		part_kernel->random(&e->rngs[block], r,
+				    (PART_RANDOMS * n + PART_LANES - 1) /
+					    PART_LANES * PART_LANES);
+		for (int i = 0; i < n; i++)
+			part_init(e, first + e->counts[block]++, e->spawn_x,
+				  e->spawn_y, &r[PART_RANDOMS * i]);
+	}
+}
+
+static void emitter_block_job(void *data, int block, int worker)
+{
+	struct l_emitter *e = data;
+	int first = block * PART_BLOCK_SIZE;
+	int last = first + e->counts[block];
+
+	part_kernel->update(e, first, last);
+	e->counts[block] = emitter_kill(e, first, last);
+	emitter_spawn(e, block);
+}
+
+// move and age particles, remove the dead ones and replace them by new
+// particles around x,y, a block per job. Blocks and their random numbers do
+// not depend on the number of workers, so a seed always gives the same
+// particles
+static void emitter_update(struct l_emitter *e, struct l_workers *workers,
+			   int x, int y)
+{
+	e->spawn_x = x;
+	e->spawn_y = y;
+	workers_run(workers, emitter_block_job, e, e->nb_blocks);
+	e->nb_particles = e->size;
+}
+
+///////////////////////////////////////////////////////
+// particles batch functions
+///////////////////////////////////////////////////////
+
+static void part_batches_free()
+{
+	for (int i = 0; i < TOTAL_PART_BATCHES; i++) {
+		free(part_batches[i].vertices);
+		part_batches[i] = (struct l_part_batch){ 0 };
+	}
+	free(part_indices);
+	part_indices = NULL;
+	part_indices_size = 0;
+}
+
+// room for nb_quads more quads, the indices being shared by all batches
+static int part_batch_reserve(struct l_part_batch *b, int nb_quads)
+{
+	int size = b->nb_quads + nb_quads;
+
+	if (size > b->size) {
+		SDL_Vertex *vertices;
+
+		size = SDL_max(size, 2 * b->size);
+		vertices = realloc(b->vertices, sizeof(*vertices) * 4 * size);
+		if (!vertices)
+			return -ENOMEM;
+		b->vertices = vertices;
+		b->size = size;
+	}
+
+	if (size > part_indices_size) {
+		int *indices = realloc(part_indices, sizeof(*indices) * 6 * size);
+
+		if (!indices)
+			return -ENOMEM;
+		for (int i = part_indices_size; i < size; i++) {
+			int *quad = &indices[6 * i];
+
+			quad[0] = 4 * i;
+			quad[1] = 4 * i + 1;
+			quad[2] = 4 * i + 2;
+			quad[3] = 4 * i + 2;
+			quad[4] = 4 * i + 1;
+			quad[5] = 4 * i + 3;
+		}
+		part_indices = indices;
+		part_indices_size = size;
+	}
+
+	return 0;
+}
+
+static inline void part_batch_add(struct l_part_batch *b, float x, float y,
+				  float w, float h, SDL_Color color)
+{
+	SDL_Vertex *v = &b->vertices[4 * b->nb_quads++];
+
+	v[0] = (SDL_Vertex){ { x, y }, color, { 0, 0 } };
+	v[1] = (SDL_Vertex){ { x + w, y }, color, { 1, 0 } };
+	v[2] = (SDL_Vertex){ { x, y + h }, color, { 0, 1 } };
+	v[3] = (SDL_Vertex){ { x + w, y + h }, color, { 1, 1 } };
+}
+
+// add the quads of the particles of an emitter to the batch of their
+// texture, and the shimmer of every other frame to the white one
+static int part_batches_add_emitter(struct l_emitter *e)
+{
+	int counts[TOTAL_PART_BATCHES] = { 0 };
+	SDL_Color color = { 0xFF, 0xFF, 0xFF, PART_ALPHA };
+	float w[TOTAL_PART_BATCHES], h[TOTAL_PART_BATCHES];
+
+	for (int b = 0; b < e->nb_blocks; b++) {
+		int first = b * PART_BLOCK_SIZE;
+
+		for (int i = first; i < first + e->counts[b]; i++) {
+			counts[e->type[i]]++;
+			counts[PART_SHIMMER] += e->frame[i] % 2 == 0;
+		}
+	}
+	for (int i = 0; i < TOTAL_PART_BATCHES; i++) {
+		struct l_texture *t = part_batch_texture(i);
+
+		if (part_batch_reserve(&part_batches[i], counts[i]) < 0) {
+			printf("Failed to alloc %d particles quads!\n",
+			       counts[i]);
+			return -ENOMEM;
+		}
+		w[i] = t->width;
+		h[i] = t->height;
+	}
+
+	for (int b = 0; b < e->nb_blocks; b++) {
+		int first = b * PART_BLOCK_SIZE;
+
+		for (int i = first; i < first + e->counts[b]; i++) {
+			float x = e->pos_x[i];
+			float y = e->pos_y[i];
+			int type = e->type[i];
+
+			part_batch_add(&part_batches[type], x, y, w[type],
+				       h[type], color);
+			if (e->frame[i] % 2 == 0)
+				part_batch_add(&part_batches[PART_SHIMMER], x,
+					       y, w[PART_SHIMMER],
+					       h[PART_SHIMMER], color);
+		}
+	}
+
+	return 0;
+}
+
+// draw each batch at once and empty it
+static void part_batches_render()
+{
+	for (int i = 0; i < TOTAL_PART_BATCHES; i++) {
+		struct l_part_batch *b = &part_batches[i];
+
+		if (!b->nb_quads)
+			continue;
+		SDL_RenderGeometry(renderer, part_batch_texture(i)->texture,
+				   b->vertices, 4 * b->nb_quads, part_indices,
+				   6 * b->nb_quads);
+		b->nb_quads = 0;
+	}
 }
 
 ///////////////////////////////////////////////////////
@@ -258,29 +969,29 @@ static void texture_render(struct l_texture *t, int x, int y)
 	SDL_RenderCopy(renderer, t->texture, NULL, &render_quad);
 }
 
-static void mo_part_render(struct l_moving_object *mo)
+static struct l_texture *part_batch_texture(int batch)
 {
-	// go through particles
-	for (int i = 0; i < TOTAL_PARTICLES; i++) {
-		// delete and replace old particles
-		if (part_is_dead(mo->particles[i])) {
-			free(mo->particles[i]);
-			mo->particles[i] = calloc(1, sizeof(*mo->particles[0]));
-			// TODO: check no ENOMEM happened...
-			part_init(mo->particles[i], mo->pos_x, mo->pos_y);
-		}
-	}
+	return batch == PART_SHIMMER ? &part_white_texture :
+				       part_textures[batch];
+}
+
+static void mo_part_render(struct l_moving_object *mo,
+			   struct l_workers *workers)
+{
+	struct l_emitter *e = &mo->emitter;
+
+	// replace old particles
+	emitter_update(e, workers, mo->pos_x, mo->pos_y);
 
 	// display particles
-	for (int i = 0; i < TOTAL_PARTICLES; i++) {
-		part_render(mo->particles[i]);
-	}
+	if (part_batches_add_emitter(e) == 0)
+		part_batches_render();
 }
 
-static void mo_render(struct l_moving_object *mo)
+static void mo_render(struct l_moving_object *mo, struct l_workers *workers)
 {
 	texture_render(&lion_head_texture, mo->pos_x, mo->pos_y);
-	mo_part_render(mo);
+	mo_part_render(mo, workers);
 }
 
 static int load_media()
@@ -315,11 +1026,7 @@ static int load_media()
 		return ret;
 	}
 
-	SDL_SetTextureAlphaMod(part_red_texture.texture, 192);
-	SDL_SetTextureAlphaMod(part_green_texture.texture, 192);
-	SDL_SetTextureAlphaMod(part_yellow_texture.texture, 192);
-	SDL_SetTextureAlphaMod(part_white_texture.texture, 192);
-
+	// particles alpha is set by their vertices
 	return 0;
 }
 
@@ -331,6 +1038,7 @@ static void leave()
 	free_ltexture(&part_green_texture);
 	free_ltexture(&part_yellow_texture);
 	free_ltexture(&part_white_texture);
+	part_batches_free();
 
 	// destroy window
 	SDL_DestroyRenderer(renderer);
@@ -343,25 +1051,220 @@ static void leave()
 	SDL_Quit();
 }
 
+///////////////////////////////////////////////////////
+// benchmark functions
+///////////////////////////////////////////////////////
+
+static double bench_ms(Uint64 start, Uint64 end)
+{
+	return (double)(end - start) * 1000.0 / SDL_GetPerformanceFrequency();
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+// sort the times of a stage and print their statistics
+static void bench_report(char *stage, double *times, int frames,
+			 long particles)
+{
+	double total = 0;
+
+	for (int f = 0; f < frames; f++)
+		total += times[f];
+	qsort(times, frames, sizeof(*times), bench_compare);
+	printf("%-8s mean %8.3f  p50 %8.3f  p99 %8.3f  max %8.3f  %6.1f M/s\n",
+	       stage, total / frames, times[frames / 2],
+	       times[frames * 99 / 100], times[frames - 1],
+	       (double)particles * frames / total / 1000.0);
+}
+
+// hash of the alive particles, the same for a seed whatever the number of
+// workers
+static uint32_t bench_checksum(struct l_emitter *e)
+{
+	uint32_t h = 2166136261u;
+
+	for (int b = 0; b < e->nb_blocks; b++) {
+		int first = b * PART_BLOCK_SIZE;
+
+		for (int i = first; i < first + e->counts[b]; i++) {
+			uint32_t v[4];
+
+			memcpy(&v[0], &e->pos_x[i], sizeof(v[0]));
+			memcpy(&v[1], &e->pos_y[i], sizeof(v[1]));
+			v[2] = e->frame[i];
+			v[3] = e->type[i];
+			for (int j = 0; j < 4; j++)
+				h = (h ^ v[j]) * 16777619u;
+		}
+	}
+
+	return h;
+}
+
+// update emitters spread over the screen and build their quads without
+// drawing them, timing both stages of every frame
+static int bench_run(struct l_workers *workers, int frames, int nb_emitters,
+		     int nb_particles, uint32_t seed)
+{
+	uint32_t checksum = 0;
+
+	struct l_emitter *emitters;
+	double *times;
+	int ret = 0;
+
+	emitters = calloc(nb_emitters, sizeof(*emitters));
+	times = calloc(2 * frames, sizeof(*times));
+	if (!emitters || !times) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (int i = 0; i < nb_emitters; i++) {
+		ret = emitter_init(&emitters[i], nb_particles, seed + i);
+		if (ret < 0)
+			goto out;
+	}
+
+	printf("bench: %d emitters of %d particles, %d frames, %s kernel, %d threads\n",
+	       nb_emitters, nb_particles, frames, part_kernel->name,
+	       workers->nb_workers + 1);
+
+	for (int f = 0; f < frames && ret == 0; f++) {
+		Uint64 t0, t1, t2;
+
+		t0 = SDL_GetPerformanceCounter();
+		for (int i = 0; i < nb_emitters; i++)
+			emitter_update(&emitters[i], workers,
+				       SCREEN_WIDTH * (i + 1) / (nb_emitters + 1),
+				       SCREEN_HEIGHT / 2);
+		t1 = SDL_GetPerformanceCounter();
+		for (int i = 0; i < nb_emitters && ret == 0; i++)
+			ret = part_batches_add_emitter(&emitters[i]);
+		for (int i = 0; i < TOTAL_PART_BATCHES; i++)
+			part_batches[i].nb_quads = 0;
+		t2 = SDL_GetPerformanceCounter();
+
+		times[f] = bench_ms(t0, t1);
+		times[frames + f] = bench_ms(t1, t2);
+	}
+	if (ret < 0)
+		goto out;
+
+	printf("stage (ms), particles per second\n");
+	bench_report("update", times, frames, (long)nb_emitters * nb_particles);
+	bench_report("batch", &times[frames], frames,
+		     (long)nb_emitters * nb_particles);
+	for (int i = 0; i < nb_emitters; i++)
+		checksum = checksum * 31 + bench_checksum(&emitters[i]);
+	printf("checksum: %08x\n", checksum);
+
+out:
+	part_batches_free();
+	if (emitters)
+		for (int i = 0; i < nb_emitters; i++)
+			emitter_free(&emitters[i]);
+	free(emitters);
+	free(times);
+	return ret;
+}
+
 ///////////////////////////////////////////////////////
 // main
 ///////////////////////////////////////////////////////
 
-int main()
+static void usage(char *name)
+{
+	printf("usage: %s [-k kernel] [-j threads] [-s seed]\n"
+	       "       [-b frames [-e emitters] [-n particles]]\n",
+	       name);
+	printf("  -k: particles update kernel (default the widest supported)\n");
+	for (int i = 0; i < TOTAL_PART_KERNELS; i++)
+		if (part_kernel_supported(&part_kernels[i]))
+			printf("      %s\n", part_kernels[i].name);
+	printf("  -j: threads updating the particles, up to %d (default one per core)\n",
+	       MAX_WORKERS + 1);
+	printf("  -s: seed of the particles (default the time)\n");
+	printf("  -b: run a headless benchmark over the given number of frames\n");
+	printf("  -e: benchmark emitters (default 1)\n");
+	printf("  -n: particles per benchmark emitter (default %d)\n",
+	       BENCH_PARTICLES);
+}
+
+int main(int argc, char **argv)
 {
 	int quit = 0;
+	int opt, ret;
 	SDL_Event e;
+	char *kernel = NULL;
+	int bench_frames = 0;
+	int bench_emitters = 1;
+	int bench_particles = BENCH_PARTICLES;
+	int nb_threads = SDL_GetCPUCount();
+	uint32_t seed = time(NULL);
+
+	struct l_workers workers;
+	struct l_moving_object mo = { 0 };
 
-	//struct l_particle part_0 = { 0 };
+	while ((opt = getopt(argc, argv, "k:j:s:b:e:n:h")) != -1) {
+		switch (opt) {
+		case 'k':
+			kernel = optarg;
+			break;
+		case 'j':
+			nb_threads = atoi(optarg);
+			if (nb_threads < 1 || nb_threads > MAX_WORKERS + 1) {
+				usage(argv[0]);
+				return -EINVAL;
+			}
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			bench_frames = atoi(optarg);
+			break;
+		case 'e':
+			bench_emitters = atoi(optarg);
+			break;
+		case 'n':
+			bench_particles = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : -EINVAL;
+		}
+	}
+	if (bench_frames < 0 || bench_emitters <= 0 || bench_particles <= 0) {
+		usage(argv[0]);
+		return -EINVAL;
+	}
 
-	struct l_moving_object mo = { 0 };
-	for (int i = 0; i < TOTAL_PARTICLES; i++) {
-		mo.particles[i] = calloc(1, sizeof(*mo.particles[0]));
-		// TODO: check no ENOMEM happened...
-		part_init(mo.particles[i], mo.pos_x, mo.pos_y);
+	part_kernel = part_kernel_select(kernel);
+	if (!part_kernel) {
+		usage(argv[0]);
+		return -EINVAL;
+	}
+
+	ret = workers_init(&workers, SDL_min(nb_threads - 1, MAX_WORKERS));
+	if (ret < 0)
+		return ret;
+
+	if (bench_frames) {
+		ret = bench_run(&workers, bench_frames, bench_emitters,
+				bench_particles, seed);
+		workers_free(&workers);
+		return ret;
 	}
 
-	srand(time(NULL));
+	ret = emitter_init(&mo.emitter, TOTAL_PARTICLES, seed);
+	if (ret < 0) {
+		workers_free(&workers);
+		return ret;
+	}
 
 	init();
 	load_media();
@@ -387,7 +1290,7 @@ int main()
 		SDL_RenderClear(renderer);
 
 		//render character
-		mo_render(&mo);
+		mo_render(&mo, &workers);
 
 		//update screen
 		SDL_RenderPresent(renderer);
@@ -395,9 +1298,8 @@ int main()
 		SDL_Delay(1000 / 60);
 	}
 
-	for (int i = 0; i < TOTAL_PARTICLES; i++) {
-		free(mo.particles[i]);
-	}
+	emitter_free(&mo.emitter);
+	workers_free(&workers);
 
 	leave();
 
@@ -6,7 +6,13 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
 #include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
 
 #define MO_WIDTH 64
 #define MO_HEIGHT 64
@@ -16,15 +22,169 @@
 #define SCREEN_WIDTH 640
 #define SCREEN_HEIGHT 480
 
-//The dimensions of the level
-#define LEVEL_WIDTH 1280
-#define LEVEL_HEIGHT 960
-
 //Tile constants
 #define TILE_WIDTH 80
 #define TILE_HEIGHT 80
-#define TOTAL_TILES 192
-#define TOTAL_TILE_SPRITES 12
+#define TOTAL_TILE_SPRITES 14
+// a tile type is one byte, types without sprite have an empty clip
+#define TOTAL_TILE_TYPES 256
+// type of tiles whose chunk is not loaded
+#define TILE_NONE -1
+// transparent tile, lets lower layers show through
+#define TILE_EMPTY 0xFF
+
+// Layer flags
+// layer content never changes, it is drawn from baked chunks
+#define LAYER_STATIC 0x1
+// walls of this layer block moving objects
+#define LAYER_COLLISION 0x2
+// parallax of a layer scrolling with the camera
+#define LAYER_PARALLAX_ONE 256
+
+// Binary tile map constants
+#define MAP_MAGIC "TMAP"
+// version 2 added layer descriptions, version 1 maps have default ones
+#define MAP_VERSION 2
+#define MAP_MAX_LAYERS 8
+// tiles are stored by square chunks of 64x64 tiles (one byte per tile), so
+// a chunk is exactly one 4 KiB page of the file
+#define MAP_CHUNK_SHIFT 6
+#define MAP_CHUNK_TILES (1 << MAP_CHUNK_SHIFT)
+#define MAP_CHUNK_MASK (MAP_CHUNK_TILES - 1)
+#define MAP_CHUNK_SIZE (MAP_CHUNK_TILES * MAP_CHUNK_TILES)
+// tile data starts on the first page boundary after the header
+#define MAP_DATA_OFFSET 4096
+
+// Level streaming constants
+// chunks kept loaded around the ones seen by the camera
+#define STREAM_MARGIN 1
+// chunks prefetched ahead of the camera in its moving direction
+#define STREAM_LOOKAHEAD 2
+// chunks loaded by the streaming thread waiting for the main thread
+#define STREAM_QUEUE_SIZE 64
+// chunks freed by the main thread per frame at most
+#define STREAM_EVICT_BUDGET 8
+
+// Chunk streaming states
+#define CHUNK_UNLOADED 0
+// being loaded by the streaming thread or the main thread
+#define CHUNK_LOADING 1
+// loaded, waiting in the streaming queue
+#define CHUNK_LOADED 2
+// tiles usable by the main thread
+#define CHUNK_RESIDENT 3
+
+// Baked chunks constants
+// size in pixels of the textures the static tile layer is baked into
+#define BAKE_CHUNK_SIZE 512
+// baked chunks seen at most along each axis, the camera being below twice
+// the screen size in LOD pixels
+#define BAKE_VISIBLE_X ((2 * SCREEN_WIDTH - 1) / BAKE_CHUNK_SIZE + 2)
+#define BAKE_VISIBLE_Y ((2 * SCREEN_HEIGHT - 1) / BAKE_CHUNK_SIZE + 2)
+// number of baked textures kept per LOD, enough for every layer of a view so
+// a still camera bakes nothing after its first frame. The least recently used
+// one is re-baked when a chunk not in the cache gets visible. Textures are
+// only created when a slot is first used
+#define BAKE_CACHE_SLOTS (BAKE_VISIBLE_X * BAKE_VISIBLE_Y * MAP_MAX_LAYERS)
+
+// Worker threads constants
+#define MAX_WORKERS 8
+
+// Pathfinding constants
+// tiles searched around the box of the start and goal tiles
+#define PATH_MARGIN 16
+// largest search window side, in tiles
+#define PATH_MAX_WINDOW 256
+#define PATH_COST_STRAIGHT 10
+#define PATH_COST_DIAGONAL 14
+// path request status
+#define PATH_NOT_FOUND 0
+#define PATH_FOUND 1
+// start and goal too far apart for the search window
+#define PATH_TOO_FAR 2
+
+// Flow field constants
+// chunks covered around the chunk of the goal, on each side
+#define FLOW_RADIUS 4
+#define FLOW_UNREACHED UINT32_MAX
+// flow directions are indexes in g_flow_dirs, diagonal ones being odd
+#define FLOW_DIR_NONE 8
+// chunk relaxing from its border tiles only, or from all its tiles
+#define FLOW_RELAX_BORDER 1
+#define FLOW_RELAX_FULL 2
+
+// Raycasting constants
+// rays walked together by the inner loop, a multiple of the SIMD width
+#define RAY_LANES 8
+// rays per worker job
+#define RAY_JOB_SIZE 256
+
+// Fog of war constants
+// sight of observers, in tiles
+#define FOG_RADIUS 8
+// texel alpha of tiles never seen, and of tiles seen before but not in sight
+#define FOG_HIDDEN 0xFF
+#define FOG_REVEALED 0xA0
+
+// Minimap constants
+// largest side of the minimap, in pixels
+#define MINIMAP_SIZE 160
+// space left to the screen borders, in pixels
+#define MINIMAP_MARGIN 8
+
+// Map generator constants
+// rooms are carved at least this far from the borders of their chunk, tiles
+#define GEN_ROOM_MARGIN 2
+#define GEN_ROOM_MIN 8
+#define GEN_CORRIDOR_WIDTH 2
+// carved tiles of a chunk
+#define GEN_ROCK 0
+#define GEN_CORRIDOR 1
+#define GEN_ROOM 2
+
+// Benchmark constants
+// agents moved against walls every frame, around the camera
+#define BENCH_AGENTS 512
+// camera speed along the sweep path, in screen pixels per frame
+#define BENCH_CAMERA_SPEED 24
+// frames between two camera teleports along the jump path
+#define BENCH_JUMP_FRAMES 30
+#define BENCH_PATH_SWEEP 0
+#define BENCH_PATH_JUMP 1
+#define TOTAL_BENCH_PATHS 2
+// agents routed per frame, to tiles around the camera
+#define BENCH_PATH_REQUESTS 128
+#define BENCH_PATH_RANGE 24
+// line of sight checks per frame, between agents
+#define BENCH_RAYS 4096
+#define BENCH_STAGE_COLLISION 0
+#define BENCH_STAGE_PATH 1
+#define BENCH_STAGE_RAYS 2
+#define BENCH_STAGE_FOG 3
+#define BENCH_STAGE_CULLING 4
+#define BENCH_STAGE_RENDER 5
+#define BENCH_STAGE_FRAME 6
+#define TOTAL_BENCH_STAGES 7
+
+// Level of detail constants
+// tile sheet mips, each one half the size of the previous one. Tile sizes
+// are multiples of 1 << (TOTAL_LODS - 1), so mip tiles stay whole.
+#define TOTAL_LODS 5
+// from this LOD, animated tiles are baked with their current frame instead
+// of being drawn over the baked chunks every frame
+#define LOD_STILL_ANIMS 2
+
+// Camera zoom constants, in screen pixels per level pixel
+#define ZOOM_MIN (1.0f / (1 << (TOTAL_LODS - 1)))
+#define ZOOM_MAX 2.0f
+// zoom factor of a key press or wheel step
+#define ZOOM_STEP 1.41421356f
+
+// Level rendering modes
+#define RENDER_TILES 0
+#define RENDER_CHUNKS 1
+#define RENDER_GEOMETRY 2
+#define TOTAL_RENDER_MODES 3
 
 //The different tile sprites
 #define TILE_WOOD 0
@@ -39,18 +199,382 @@
 #define TILE_BOTTOMLEFT 9
 #define TILE_LEFT 10
 #define TILE_TOPLEFT 11
+#define TILE_WATER 12
+#define TILE_LAVA 13
+
+// Animated tiles constants
+#define TOTAL_TILE_ANIMS 2
 
 #define PATH_TO_LION "../medias/lion_head.png"
 #define PATH_TO_TILES "../medias/tiles_array.png"
-#define PATH_TO_MAP "../medias/39.map"
+#define PATH_TO_MAP "../medias/39.tmap"
 
-struct l_tile {
-	// attribute of the tile
-	SDL_Rect box;
-	// tile type
+struct l_map_layer {
+	// LAYER_* flags
+	uint16_t flags;
+	// layer scrolling speed, LAYER_PARALLAX_ONE being the camera speed.
+	// Lower values move slower and look further away.
+	uint16_t parallax;
+};
+
+// header of a binary tile map file, little endian. It is followed, from
+// MAP_DATA_OFFSET, by layer_count layers of chunks_x * chunks_y chunks,
+// chunks being stored row by row and tiles row by row inside a chunk.
+struct l_map_header {
+	char magic[4];
+	uint16_t version;
+	uint16_t layer_count;
+	// map size, in tiles
+	uint32_t width;
+	uint32_t height;
+	// tile size, in pixels
+	uint16_t tile_width;
+	uint16_t tile_height;
+	// chunk side, in tiles. Must be MAP_CHUNK_TILES
+	uint16_t chunk_tiles;
+	uint16_t reserved;
+	// since version 2, layers from the bottom one to the top one
+	struct l_map_layer layers[MAP_MAX_LAYERS];
+};
+
+struct l_map {
+	// tile types of every layer, stored by chunks
+	uint8_t *data;
+	// map size, in tiles
+	int width;
+	int height;
+	int layer_count;
+	// tile size, in pixels
+	int tile_w;
+	int tile_h;
+	// number of chunks per row and per column, and per layer
+	int chunks_x;
+	int chunks_y;
+	int layer_chunks;
+	struct l_map_layer layers[MAP_MAX_LAYERS];
+	// layer whose walls block moving objects
+	int collision_layer;
+	// file mapping, NULL if data was allocated by an ascii map load
+	void *mapping;
+	size_t mapping_len;
+	// binary map file, resident chunks are read from it. Only valid with
+	// a mapping
+	int fd;
+};
+
+// range of tiles, bounds included
+struct l_tile_range {
+	int col_min;
+	int col_max;
+	int row_min;
+	int row_max;
+};
+
+// level built from a map, whose chunks are loaded around the camera by a
+// streaming thread and evicted once far enough
+struct l_level {
+	struct l_map *map;
+
+	// Chunks of every layer are streamed around the layer camera. A chunk
+	// id is its index in the map data: layer * layer_chunks + cy *
+	// chunks_x + cx.
+
+	// main thread only
+	// tile types of every chunk in the map data, row by row, NULL if the
+	// chunk is not resident. Written with the lock held, so other threads
+	// may read it under the lock
+	uint8_t **chunk_types;
+	// non zero for chunks not resident during a reload, which may have
+	// changed. They are read again once resident
+	uint8_t *chunk_stale;
+	// hash of the tiles of every chunk when last resident, 0 if it never
+	// was
+	uint64_t *tiles_hash;
+	// per chunk of a layer, hash of the collision layer walls when last
+	// resident, 0 if it never was
+	uint64_t *walls_hash;
+	// per chunk of a layer, incremented when a reload changes the walls,
+	// and the tiles, of the collision layer
+	uint32_t *walls_version;
+	uint32_t *tiles_version;
+	// ids of resident chunks
+	int *resident;
+	int nb_resident;
+	int resident_size;
+	// chunks requested to the streaming thread, per layer
+	struct l_tile_range request[MAP_MAX_LAYERS];
+	int dir_x;
+	int dir_y;
+
+	// shared with the streaming thread, protected by lock
+	SDL_Thread *thread;
+	SDL_mutex *lock;
+	// wakes up the streaming thread when the request changes
+	SDL_cond *request_cond;
+	// signaled each time a chunk is loaded
+	SDL_cond *loaded_cond;
+	int quit;
+	// CHUNK_* state of every chunk
+	uint8_t *chunk_state;
+	// wall bitmap, one bit per tile. A row of tiles is chunks_x words, so
+	// a word is one tile row of a chunk and is written when the chunk is
+	// loaded, by the thread loading it.
+	uint64_t *walls;
+	// copy of the request for the streaming thread
+	struct l_tile_range stream_request[MAP_MAX_LAYERS];
+	int stream_dir_x;
+	int stream_dir_y;
+	// chunks loaded and not handed to the main thread yet
+	int loaded[STREAM_QUEUE_SIZE];
+	int nb_loaded;
+};
+
+// animated tile type, its frames being consecutive cells of a tile sheet
+// row
+struct l_tile_anim {
+	int type;
+	// clip position of the first frame
+	int x;
+	int y;
+	int nb_frames;
+	// frame duration in milliseconds
+	Uint32 frame_ms;
+};
+
+// animated tile position in a baked chunk
+struct l_anim_tile {
+	int col;
+	int row;
 	int type;
 };
 
+// layer area of BAKE_CHUNK_SIZE pixels rendered once into a texture
+struct l_baked_chunk {
+	SDL_Texture *texture;
+	int layer;
+	// chunk coordinates, in BAKE_CHUNK_SIZE units
+	int cx;
+	int cy;
+	// frame the chunk was last drawn, 0 if the slot is free
+	Uint32 last_used;
+	// animated tiles left out of the texture, drawn over it every frame
+	struct l_anim_tile *anims;
+	int nb_anims;
+	int anims_size;
+};
+
+// visible tiles gathered to be drawn with a single geometry call
+struct l_tile_batch {
+	SDL_Vertex *vertices;
+	int *indices;
+	// tiles in the batch
+	int nb_tiles;
+	// tiles the buffers can hold
+	int capacity;
+};
+
+// path between two tiles of the collision layer
+struct l_path_request {
+	// tile coordinates
+	SDL_Point start;
+	SDL_Point goal;
+	// PATH_* status
+	int status;
+	// tiles where the path turns, from the start to the goal, both
+	// included. The buffer is kept from one request to the next.
+	SDL_Point *points;
+	int nb_points;
+	int points_size;
+};
+
+// node waiting in an open list
+struct l_path_open {
+	// cost from the start plus estimated cost to the goal
+	uint32_t f;
+	int node;
+};
+
+// binary heap on f, nodes are pushed again instead of being updated
+struct l_open_list {
+	struct l_path_open *heap;
+	int len;
+	int size;
+};
+
+// search memory of a thread, allocated once for the largest window and
+// reused by every request
+struct l_path_search {
+	// tiles searched and wall bitmap of the current request
+	SDL_Rect window;
+	SDL_Point goal;
+	uint64_t *walls;
+	int stride;
+	// per window node: open or closed when the stamp is the one of the
+	// current request, cost from the start and node it was reached from
+	uint32_t *stamp;
+	uint32_t stamp_base;
+	uint32_t *cost;
+	int32_t *parent;
+	struct l_open_list open;
+};
+
+struct l_workers;
+
+struct l_worker {
+	struct l_workers *workers;
+	SDL_Thread *thread;
+	// index given to jobs, to pick per thread memory
+	int index;
+};
+
+// threads running batches of jobs with the thread submitting them, which is
+// the worker of index nb_workers
+struct l_workers {
+	struct l_worker workers[MAX_WORKERS];
+	int nb_workers;
+	SDL_mutex *lock;
+	SDL_cond *work_cond;
+	SDL_cond *done_cond;
+	// current batch, index of its next job to run and jobs done
+	void (*func)(void *data, int job, int worker);
+	void *data;
+	int nb_jobs;
+	int next;
+	int nb_done;
+	int quit;
+};
+
+// routes batches of path requests on worker threads
+struct l_path_service {
+	struct l_level *level;
+	struct l_workers *workers;
+	// one per worker, plus one for the thread running batches
+	struct l_path_search searches[MAX_WORKERS + 1];
+	// current batch
+	struct l_path_request *requests;
+};
+
+// costs to reach a goal tile from the tiles of the chunks around it, and
+// directions to follow, shared by any number of agents
+struct l_flow_field {
+	struct l_level *level;
+	struct l_workers *workers;
+	SDL_Point goal;
+	// chunks covered
+	int cx;
+	int cy;
+	int chunks_w;
+	int chunks_h;
+	// tiles covered
+	int x;
+	int y;
+	int width;
+	int height;
+	// integration field: cost to the goal of every tile, row by row
+	uint32_t *cost;
+	// bit d set when moving in direction d is allowed, per tile
+	uint8_t *moves;
+	// direction field: index of the neighbour to move to
+	uint8_t *dir;
+	// per chunk: level walls version the costs were computed with, walls
+	// changed, moves to update, costs to relax, border costs changed by
+	// the last relaxing, directions to update
+	uint32_t *walls_version;
+	uint8_t *walls_changed;
+	uint8_t *moves_dirty;
+	uint8_t *active;
+	uint8_t *border_changed;
+	uint8_t *dir_dirty;
+	// chunks of the batch being run
+	int *jobs;
+	int nb_jobs;
+	// search memory of every worker
+	struct l_open_list open[MAX_WORKERS + 1];
+};
+
+// segments cast against the walls, stored by coordinate for the inner loop
+// to read several rays at once
+struct l_ray_batch {
+	// start and end, in level pixels
+	float *x0;
+	float *y0;
+	float *x1;
+	float *y1;
+	// fraction of the segment travelled before a wall, 1 if none
+	float *hit;
+	int nb_rays;
+	int size;
+};
+
+struct l_ray_job {
+	struct l_level *level;
+	struct l_ray_batch *batch;
+};
+
+struct l_gen_job {
+	struct l_map *map;
+	uint32_t seed;
+};
+
+// tiles seen by observers, through the walls of the collision layer
+struct l_fog {
+	struct l_level *level;
+	struct l_workers *workers;
+	// one bit per tile, rows of chunks_x words as the level walls
+	uint64_t *visible;
+	// tiles seen at least once
+	uint64_t *revealed;
+	int stride;
+	// tile of every observer when its sight was cast
+	SDL_Point *observers;
+	int nb_observers;
+	int observers_size;
+	// observer tiles sorted without duplicates, observers on the same tile
+	// seeing the same tiles
+	SDL_Point *eyes;
+	int nb_eyes;
+	// sight areas left or entered by observers since the last update, their
+	// tiles and the range around them
+	struct l_tile_range *dirty;
+	int nb_dirty;
+	int dirty_size;
+	uint64_t *dirty_tiles;
+	struct l_tile_range dirty_range;
+	struct l_ray_batch rays;
+	// one texel per tile of the camera range, streamed when it changes
+	SDL_Texture *texture;
+	int texture_w;
+	int texture_h;
+	struct l_tile_range texture_range;
+	int texture_dirty;
+};
+
+// whole collision layer downsampled into a texture, updated where a reload
+// changed tiles
+struct l_minimap {
+	struct l_level *level;
+	// tiles per texel side, and pixels per texel side
+	int step;
+	int zoom;
+	// size in texels
+	int width;
+	int height;
+	// texture content, zoom x zoom pixels per texel
+	Uint32 *pixels;
+	SDL_Texture *texture;
+	// tiles_version of the collision layer chunks the texels were computed
+	// with
+	uint32_t *versions;
+};
+
+// map file watched for changes
+struct l_map_watch {
+	// inotify instance watching the file directory, -1 if not watching
+	int fd;
+	// file name in its directory
+	char *name;
+};
+
 struct l_texture {
 	SDL_Texture *texture;
 	int width;
@@ -65,7 +589,27 @@ struct l_moving_object {
 	SDL_Rect box;
 };
 
-SDL_Rect g_tile_clips[TOTAL_TILE_SPRITES] = { 0 };
+// clip of every tile type. Tiles only store their type, so animating a
+// type is changing its clip once per frame.
+SDL_Rect g_tile_clips[TOTAL_TILE_TYPES] = { 0 };
+// animated tile types, all driven by the same clock
+struct l_tile_anim g_tile_anims[TOTAL_TILE_ANIMS] = {
+	{ TILE_WATER, 0, 240, 4, 200 },
+	{ TILE_LAVA, 0, 320, 4, 300 },
+};
+// non zero for animated tile types
+uint8_t g_tile_animated[TOTAL_TILE_TYPES];
+// minimap color of every tile type, ARGB. Types without sprite are
+// transparent.
+Uint32 g_minimap_colors[TOTAL_TILE_TYPES] = {
+	[TILE_WOOD] = 0xFFE8A040,	 [TILE_MARBLE] = 0xFFE0C8C0,
+	[TILE_SKY] = 0xFFA8B8F0,	 [TILE_CENTER] = 0xFF000000,
+	[TILE_TOP] = 0xFF999999,	 [TILE_TOPRIGHT] = 0xFF999999,
+	[TILE_RIGHT] = 0xFF999999,	 [TILE_BOTTOMRIGHT] = 0xFF999999,
+	[TILE_BOTTOM] = 0xFF999999,	 [TILE_BOTTOMLEFT] = 0xFF999999,
+	[TILE_LEFT] = 0xFF999999,	 [TILE_TOPLEFT] = 0xFF999999,
+	[TILE_WATER] = 0xFF2080E0,	 [TILE_LAVA] = 0xFFD04010,
+};
 
 ///////////////////////////////////////////////////////
 // global variables
@@ -77,14 +621,47 @@ SDL_Window *g_window;
 SDL_Renderer *g_renderer;
 // scene textures
 struct l_texture g_mo_texture;
-struct l_texture g_tiles_texture;
+// tile sheet and its mips, one per LOD
+struct l_texture g_tiles_textures[TOTAL_LODS];
+// static tile layers baked into textures, a cache per LOD
+struct l_baked_chunk g_baked_chunks[TOTAL_LODS][BAKE_CACHE_SLOTS];
+Uint32 g_frame;
+// camera zoom, in screen pixels per level pixel
+float g_zoom = 1;
+// level rendering mode
+int g_render_mode = RENDER_CHUNKS;
+char *g_render_mode_names[TOTAL_RENDER_MODES] = { "tiles", "chunks",
+						  "geometry" };
+// vertex and index buffers, kept from one frame to the next
+struct l_tile_batch g_tile_batch;
+struct l_tile_batch g_bake_batch;
+// flow directions, clockwise from the right
+SDL_Point g_flow_dirs[8] = { { 1, 0 },	{ 1, 1 },   { 0, 1 }, { -1, 1 },
+			     { -1, 0 }, { -1, -1 }, { 0, -1 }, { 1, -1 } };
+char *g_bench_path_names[TOTAL_BENCH_PATHS] = { "sweep", "jump" };
+char *g_bench_stage_names[TOTAL_BENCH_STAGES] = { "collision", "path",
+						  "rays",      "fog",
+						  "culling",   "render",
+						  "frame" };
 
 ///////////////////////////////////////////////////////
 // static functions declarations
 ///////////////////////////////////////////////////////
 
 static void tile_clips_init();
-static void tile_init(struct l_tile *tile, int x, int y, int tile_type);
+static void bake_cache_free();
+static void bake_cache_invalidate_chunk(struct l_map *map, int id);
+static void tile_batch_free(struct l_tile_batch *batch);
+static int tile_batch_reserve(struct l_tile_batch *batch, int nb_tiles);
+static void tile_batch_add(struct l_tile_batch *batch, struct l_texture *t,
+			   int x, int y, SDL_Rect *clip);
+static void tile_batch_flush(struct l_tile_batch *batch, struct l_texture *t);
+static void level_render_geometry(struct l_level *level, int layer,
+				  SDL_Rect *camera, int animated, int lod,
+				  struct l_tile_batch *batch);
+static void workers_run(struct l_workers *workers,
+			void (*func)(void *data, int job, int worker),
+			void *data, int nb_jobs);
 
 ///////////////////////////////////////////////////////
 // common functions
@@ -125,6 +702,97 @@ static int load_ltexture_from_file(char *path, struct l_texture *in)
 	return 0;
 }
 
+// halve a surface, each pixel averaging 2x2 pixels weighted by their alpha
+// so transparent pixels do not darken the tile borders
+static SDL_Surface *surface_half(SDL_Surface *src)
+{
+	SDL_Surface *dst;
+
+	dst = SDL_CreateRGBSurfaceWithFormat(0, src->w / 2, src->h / 2, 32,
+					     SDL_PIXELFORMAT_ARGB8888);
+	if (!dst)
+		return NULL;
+
+	for (int y = 0; y < dst->h; y++) {
+		Uint32 *row = (Uint32 *)((Uint8 *)dst->pixels + y * dst->pitch);
+
+		for (int x = 0; x < dst->w; x++) {
+			Uint32 sum[4] = { 0 };
+
+			for (int i = 0; i < 4; i++) {
+				Uint32 *src_row =
+					(Uint32 *)((Uint8 *)src->pixels +
+						   (2 * y + i / 2) * src->pitch);
+				Uint32 p = src_row[2 * x + i % 2];
+				Uint32 a = p >> 24;
+
+				sum[0] += (p & 0xFF) * a;
+				sum[1] += (p >> 8 & 0xFF) * a;
+				sum[2] += (p >> 16 & 0xFF) * a;
+				sum[3] += a;
+			}
+			row[x] = 0;
+			if (sum[3])
+				row[x] = sum[0] / sum[3] | sum[1] / sum[3] << 8 |
+					 sum[2] / sum[3] << 16 |
+					 sum[3] / 4 << 24;
+		}
+	}
+
+	return dst;
+}
+
+// load the tile sheet and its mips, so that zoomed out views are drawn with
+// tiles close to their size on screen
+static int tiles_load_lods(char *path)
+{
+	SDL_Surface *loaded_surface, *surface;
+
+	loaded_surface = IMG_Load(path);
+	if (!loaded_surface) {
+		printf("Unable to load image %s! SDL_image Error: %s\n", path,
+		       IMG_GetError());
+		return -EINVAL;
+	}
+
+	// cyan color keyed pixels get a zero alpha, averaged by the mips
+	SDL_SetColorKey(loaded_surface, SDL_TRUE,
+			SDL_MapRGB(loaded_surface->format, 0, 0xFF, 0xFF));
+	surface = SDL_ConvertSurfaceFormat(loaded_surface,
+					   SDL_PIXELFORMAT_ARGB8888, 0);
+	SDL_FreeSurface(loaded_surface);
+
+	for (int lod = 0; lod < TOTAL_LODS; lod++) {
+		struct l_texture *t = &g_tiles_textures[lod];
+
+		if (surface && lod > 0) {
+			SDL_Surface *half = surface_half(surface);
+
+			SDL_FreeSurface(surface);
+			surface = half;
+		}
+		if (!surface) {
+			printf("Unable to build tile sheet mips! SDL Error: %s\n",
+			       SDL_GetError());
+			return -ENOMEM;
+		}
+
+		t->texture = SDL_CreateTextureFromSurface(g_renderer, surface);
+		if (!t->texture) {
+			printf("Unable to create texture from %s! SDL Error: %s\n",
+			       path, SDL_GetError());
+			SDL_FreeSurface(surface);
+			return -EINVAL;
+		}
+		SDL_SetTextureBlendMode(t->texture, SDL_BLENDMODE_BLEND);
+		t->width = surface->w;
+		t->height = surface->h;
+	}
+	SDL_FreeSurface(surface);
+
+	return 0;
+}
+
 static void free_ltexture(struct l_texture *t)
 {
 	if (!t->texture)
@@ -135,13 +803,23 @@ static void free_ltexture(struct l_texture *t)
 	t->height = 0;
 }
 
-// init SDL, create a g_window and get its surface
-static int init()
+// init SDL, create a g_window and get its surface. A headless init uses a
+// hidden window of the dummy video driver and the software renderer.
+static int init(int headless)
 {
 	int ret;
+	Uint32 window_flags = SDL_WINDOW_SHOWN;
+	Uint32 renderer_flags = SDL_RENDERER_ACCELERATED;
 
 	tile_clips_init();
 
+	if (headless) {
+		// keep the driver chosen by the user, e.g. offscreen
+		setenv("SDL_VIDEODRIVER", "dummy", 0);
+		window_flags = SDL_WINDOW_HIDDEN;
+		renderer_flags = SDL_RENDERER_SOFTWARE;
+	}
+
 	// init SDL
 	ret = SDL_Init(SDL_INIT_VIDEO);
 	if (ret < 0) {
@@ -156,13 +834,16 @@ static int init()
 	// create g_window
 	g_window = SDL_CreateWindow("SDL_tuto", SDL_WINDOWPOS_UNDEFINED,
 				    SDL_WINDOWPOS_UNDEFINED, SCREEN_WIDTH,
-				    SCREEN_HEIGHT, SDL_WINDOW_SHOWN);
+				    SCREEN_HEIGHT, window_flags);
 	if (!g_window) {
 		printf("SDL_SetVideoMode ERROR: %s\n", SDL_GetError());
 		return -1;
 	}
 
-	g_renderer = SDL_CreateRenderer(g_window, -1, SDL_RENDERER_ACCELERATED);
+	// render targets are needed to bake tile chunks
+	g_renderer = SDL_CreateRenderer(g_window, -1,
+					renderer_flags |
+						SDL_RENDERER_TARGETTEXTURE);
 	if (!g_renderer) {
 		printf("Renderer could not be created! SDL Error: %s\n",
 		       SDL_GetError());
@@ -181,342 +862,4463 @@ static int init()
 	return 0;
 }
 
-static int set_tiles(struct l_tile *tiles, int nb_tiles)
+///////////////////////////////////////////////////////
+// tile map functions
+///////////////////////////////////////////////////////
+
+static size_t map_data_size(struct l_map *map)
+{
+	return (size_t)map->layer_count * map->chunks_x * map->chunks_y *
+	       MAP_CHUNK_SIZE;
+}
+
+static void map_set_size(struct l_map *map, int width, int height,
+			 int layer_count, int tile_w, int tile_h)
 {
-	int ret = 0;
-	uint8_t tile_type;
+	map->width = width;
+	map->height = height;
+	map->layer_count = layer_count;
+	map->tile_w = tile_w;
+	map->tile_h = tile_h;
+	map->chunks_x = (width - 1) / MAP_CHUNK_TILES + 1;
+	map->chunks_y = (height - 1) / MAP_CHUNK_TILES + 1;
+	map->layer_chunks = map->chunks_x * map->chunks_y;
+
+	// static layers scrolling with the camera, walls of the first one
+	// blocking moving objects
+	for (int i = 0; i < MAP_MAX_LAYERS; i++) {
+		map->layers[i].flags = LAYER_STATIC;
+		map->layers[i].parallax = LAYER_PARALLAX_ONE;
+	}
+	map->layers[0].flags |= LAYER_COLLISION;
+	map->collision_layer = 0;
+}
+
+// walls are read from the first layer flagged for collision
+static void map_set_collision_layer(struct l_map *map)
+{
+	map->collision_layer = 0;
+	for (int i = map->layer_count - 1; i >= 0; i--)
+		if (map->layers[i].flags & LAYER_COLLISION)
+			map->collision_layer = i;
+}
+
+// offset of the tile in the map data
+static inline size_t map_tile_index(struct l_map *map, int layer, int x, int y)
+{
+	size_t chunk = ((size_t)layer * map->chunks_y +
+			(y >> MAP_CHUNK_SHIFT)) * map->chunks_x +
+		       (x >> MAP_CHUNK_SHIFT);
+
+	return chunk * MAP_CHUNK_SIZE +
+	       ((y & MAP_CHUNK_MASK) << MAP_CHUNK_SHIFT) + (x & MAP_CHUNK_MASK);
+}
+
+// tiles overlapped by a rectangle given in level coordinates, clamped to the
+// map. Returns 0 if the rectangle is outside of the map.
+static int map_tile_range(struct l_map *map, SDL_Rect *rect,
+			  struct l_tile_range *range)
+{
+	// division rounds toward zero, a rectangle ending left of or above
+	// the map would get the first column or row
+	if (rect->w <= 0 || rect->h <= 0 || rect->x + rect->w <= 0 ||
+	    rect->y + rect->h <= 0)
+		return 0;
+
+	range->col_min = rect->x / map->tile_w;
+	range->col_max = (rect->x + rect->w - 1) / map->tile_w;
+	range->row_min = rect->y / map->tile_h;
+	range->row_max = (rect->y + rect->h - 1) / map->tile_h;
+
+	// keep the range inside the map
+	if (range->col_min < 0)
+		range->col_min = 0;
+	if (range->row_min < 0)
+		range->row_min = 0;
+	if (range->col_max >= map->width)
+		range->col_max = map->width - 1;
+	if (range->row_max >= map->height)
+		range->row_max = map->height - 1;
+
+	return range->col_min <= range->col_max &&
+	       range->row_min <= range->row_max;
+}
+
+// read and check the header of a binary map file, and set the map size from
+// it
+static int map_read_header(int fd, char *path, struct l_map *map)
+{
+	struct l_map_header header;
+	struct stat st;
+	uint64_t nb_chunks;
+
+	if (fstat(fd, &st) < 0 || st.st_size < MAP_DATA_OFFSET ||
+	    pread(fd, &header, sizeof(header), 0) != sizeof(header)) {
+		printf("Invalid map file %s\n", path);
+		return -EINVAL;
+	}
+
+	if (memcmp(header.magic, MAP_MAGIC, 4) || !header.version ||
+	    header.version > MAP_VERSION ||
+	    header.chunk_tiles != MAP_CHUNK_TILES || !header.layer_count ||
+	    header.layer_count > MAP_MAX_LAYERS ||
+	    !header.width || !header.height || !header.tile_width ||
+	    !header.tile_height || header.width > INT32_MAX ||
+	    header.height > INT32_MAX) {
+		printf("Invalid map header in %s\n", path);
+		return -EINVAL;
+	}
+
+	// chunk ids are ints and the tiles must fit in the address space
+	nb_chunks = (uint64_t)((header.width - 1) / MAP_CHUNK_TILES + 1) *
+		    ((header.height - 1) / MAP_CHUNK_TILES + 1) *
+		    header.layer_count;
+	if (nb_chunks > INT32_MAX ||
+	    nb_chunks > (SIZE_MAX - MAP_DATA_OFFSET) / MAP_CHUNK_SIZE) {
+		printf("Map %s is too large\n", path);
+		return -EINVAL;
+	}
+
+	map_set_size(map, header.width, header.height, header.layer_count,
+		     header.tile_width, header.tile_height);
+	if (header.version >= 2) {
+		memcpy(map->layers, header.layers, sizeof(map->layers));
+		map_set_collision_layer(map);
+	}
+
+	if ((size_t)st.st_size < MAP_DATA_OFFSET + map_data_size(map)) {
+		printf("Map file %s is truncated\n", path);
+		return -EINVAL;
+	}
+
+	return 0;
+}
 
-	// tiles offsets
+// map a binary map file. Tile data is used in place, nothing is parsed.
+static int map_load_binary(char *path, struct l_map *map)
+{
+	size_t len;
+	void *mapping;
+	int fd, ret;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		printf("Failed to open map file %s: %s\n", path,
+		       strerror(errno));
+		return -errno;
+	}
+
+	ret = map_read_header(fd, path, map);
+	if (ret < 0) {
+		close(fd);
+		return ret;
+	}
+
+	// private writable mapping, resident chunks are replaced by anonymous
+	// pages read from the file. The file stays open for them
+	len = MAP_DATA_OFFSET + map_data_size(map);
+	mapping = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (mapping == MAP_FAILED) {
+		ret = -errno;
+		printf("Failed to mmap map file %s: %s\n", path,
+		       strerror(errno));
+		close(fd);
+		return ret;
+	}
+
+	map->mapping = mapping;
+	map->mapping_len = len;
+	map->data = (uint8_t *)mapping + MAP_DATA_OFFSET;
+	map->fd = fd;
+
+	return 0;
+}
+
+// load a single layer ascii map: one character per tile, starting at '0',
+// one line per row of tiles
+static int map_load_ascii(char *path, struct l_map *map)
+{
+	int ret = 0;
+	int width = 0, height = 0;
 	int x = 0, y = 0;
+	char *text;
+	long len;
 
 	// open the map
-	FILE *f = fopen(PATH_TO_MAP, "r");
+	FILE *f = fopen(path, "r");
 	if (f == NULL) {
 		printf("Failed to fopen map file\n");
 		return -EINVAL;
 	}
 
-	// TODO (if not TUTO): check file size match with TOTAL_TILES
-	for (int i = 0; i < TOTAL_TILES; i++) {
-		ret = fread(&tile_type, 1, 1, f);
-		if (ret < 1) {
-			printf("Failed to fread map file at byte #%d\n", i);
-			return -EINVAL;
+	// read it at once
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	text = malloc(len + 1);
+	if (text == NULL) {
+		fclose(f);
+		return -ENOMEM;
+	}
+	if (fread(text, 1, len, f) != (size_t)len) {
+		printf("Failed to fread map file %s\n", path);
+		ret = -EINVAL;
+		goto exit;
+	}
+	text[len] = '\n';
+
+	// get map size from the lines
+	for (long i = 0; i <= len; i++) {
+		if (text[i] == '\r')
+			continue;
+		if (text[i] != '\n') {
+			x++;
+			continue;
 		}
-		// skip new line
-		if (tile_type == '\n') {
-			i--;
+		if (x == 0)
 			continue;
+		if (width && x != width) {
+			printf("Map line #%d has %d tiles instead of %d\n",
+			       height, x, width);
+			ret = -EINVAL;
+			goto exit;
 		}
+		width = x;
+		height++;
+		x = 0;
+	}
+	if (!width) {
+		printf("Map file %s is empty\n", path);
+		ret = -EINVAL;
+		goto exit;
+	}
+
+	map_set_size(map, width, height, 1, TILE_WIDTH, TILE_HEIGHT);
+	map->mapping = NULL;
+	map->data = calloc(1, map_data_size(map));
+	if (map->data == NULL) {
+		ret = -ENOMEM;
+		goto exit;
+	}
+
+	x = 0;
+	for (long i = 0; i < len; i++) {
 		// ascii offset shift to start to 0
-		tile_type -= 48;
+		uint8_t tile_type = text[i] - '0';
 
-		if (tile_type >= TOTAL_TILE_SPRITES) {
-			printf("invalid tile_type at byte #%d = %d\n", i,
-			       tile_type + 48);
-			return -EINVAL;
+		if (text[i] == '\r')
+			continue;
+		if (text[i] == '\n') {
+			if (x) {
+				x = 0;
+				y++;
+			}
+			continue;
 		}
-		tile_init(&tiles[i], x, y, tile_type);
-		// move to next tile
-		x += TILE_WIDTH;
-		// change line if need be
-		if (x >= LEVEL_WIDTH) {
-			x = 0;
-			y += TILE_HEIGHT;
+		if (tile_type >= TOTAL_TILE_SPRITES) {
+			printf("invalid tile_type at byte #%ld = %d\n", i,
+			       text[i]);
+			free(map->data);
+			map->data = NULL;
+			ret = -EINVAL;
+			goto exit;
 		}
+		map->data[map_tile_index(map, 0, x, y)] = tile_type;
+		x++;
 	}
 
+exit:
+	free(text);
 	fclose(f);
-	return 0;
+	return ret;
 }
 
-static void texture_render(struct l_texture *t, int x, int y, SDL_Rect *clip)
+// load a binary map, or an ascii one if the file has no binary map header
+static int map_load(char *path, struct l_map *map)
 {
-	// Set rendering space and render to screen
-	SDL_Rect render_quad = { x, y, t->width, t->height };
+	char magic[4] = { 0 };
+	FILE *f;
 
-	// Set clip rendering dimensions
-	if (clip != NULL) {
-		render_quad.w = clip->w;
-		render_quad.h = clip->h;
+	f = fopen(path, "r");
+	if (f == NULL) {
+		printf("Failed to fopen map file %s\n", path);
+		return -EINVAL;
 	}
+	if (fread(magic, 1, sizeof(magic), f) != sizeof(magic))
+		memset(magic, 0, sizeof(magic));
+	fclose(f);
 
-	SDL_RenderCopyEx(g_renderer, t->texture, clip, &render_quad, 0, NULL,
-			 0);
+	if (!memcmp(magic, MAP_MAGIC, sizeof(magic)))
+		return map_load_binary(path, map);
+
+	return map_load_ascii(path, map);
 }
 
-static int load_media(struct l_tile *tiles, int nb_tiles)
+// write the map in the binary format, e.g. to convert an ascii map
+static int map_save_binary(struct l_map *map, char *path)
 {
-	int ret;
+	uint8_t header_page[MAP_DATA_OFFSET] = { 0 };
+	struct l_map_header *header = (struct l_map_header *)header_page;
+	int ret = 0;
 
-	// load character
-	ret = load_ltexture_from_file(PATH_TO_LION, &g_mo_texture);
-	if (ret < 0) {
-		printf("Failed to load lion texture image!\n");
-		return ret;
+	memcpy(header->magic, MAP_MAGIC, 4);
+	header->version = MAP_VERSION;
+	header->layer_count = map->layer_count;
+	header->width = map->width;
+	header->height = map->height;
+	header->tile_width = map->tile_w;
+	header->tile_height = map->tile_h;
+	header->chunk_tiles = MAP_CHUNK_TILES;
+	memcpy(header->layers, map->layers, sizeof(header->layers));
+
+	// the map is written aside and renamed over the previous one, running
+	// games keep their mapping of the previous file instead of reading a
+	// truncated one
+	char tmp_path[strlen(path) + 5];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+	FILE *f = fopen(tmp_path, "w");
+	if (f == NULL) {
+		printf("Failed to fopen %s: %s\n", tmp_path, strerror(errno));
+		return -errno;
 	}
-	// load tile sheet
-	ret = load_ltexture_from_file(PATH_TO_TILES, &g_tiles_texture);
-	if (ret < 0) {
-		printf("Failed to load tiles texture image!\n");
-		return ret;
+
+	if (fwrite(header_page, 1, sizeof(header_page), f) !=
+		    sizeof(header_page) ||
+	    fwrite(map->data, 1, map_data_size(map), f) != map_data_size(map)) {
+		printf("Failed to write map file %s\n", tmp_path);
+		ret = -EIO;
 	}
-	// load level/tile map file
-	ret = set_tiles(tiles, nb_tiles);
-	if (ret < 0) {
-		printf("Failed to load map file!\n");
-		return ret;
+
+	if (fclose(f) && !ret)
+		ret = -EIO;
+	if (!ret && rename(tmp_path, path) < 0) {
+		printf("Failed to rename %s: %s\n", tmp_path, strerror(errno));
+		ret = -errno;
+	}
+	if (ret < 0)
+		unlink(tmp_path);
+	return ret;
+}
+
+static void map_free(struct l_map *map)
+{
+	if (map->mapping) {
+		munmap(map->mapping, map->mapping_len);
+		close(map->fd);
+	} else {
+		free(map->data);
 	}
 
-	return 0;
+	map->mapping = NULL;
+	map->data = NULL;
 }
 
-static void leave()
+///////////////////////////////////////////////////////
+// map generation functions
+///////////////////////////////////////////////////////
+
+// xorshift32, maps generated from a seed are the same on every host
+static uint32_t map_rand(uint32_t *state)
 {
-	// free loaded images
-	free_ltexture(&g_mo_texture);
-	//free_ltexture(&background_texture);
+	uint32_t x = *state;
 
-	// destroy g_window
-	SDL_DestroyRenderer(g_renderer);
-	SDL_DestroyWindow(g_window);
-	g_renderer = NULL;
-	g_window = NULL;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
 
-	//quit subsystems
-	IMG_Quit();
-	SDL_Quit();
+	return x;
 }
 
-static void tile_clips_init()
+// hash of a position, for the content of a chunk or tile to only depend on
+// the seed and where it is, whatever the order chunks are generated in
+static uint32_t map_hash(uint32_t seed, int salt, int a, int b)
 {
-	g_tile_clips[TILE_WOOD].x = 0;
-	g_tile_clips[TILE_WOOD].y = 0;
-	g_tile_clips[TILE_WOOD].w = TILE_WIDTH;
-	g_tile_clips[TILE_WOOD].h = TILE_HEIGHT;
+	uint32_t h = seed;
+	uint32_t values[3] = { salt, a, b };
 
-	g_tile_clips[TILE_MARBLE].x = 0;
-	g_tile_clips[TILE_MARBLE].y = 80;
-	g_tile_clips[TILE_MARBLE].w = TILE_WIDTH;
-	g_tile_clips[TILE_MARBLE].h = TILE_HEIGHT;
+	for (int i = 0; i < 3; i++) {
+		h ^= values[i];
+		h ^= h >> 16;
+		h *= 0x7FEB352D;
+		h ^= h >> 15;
+		h *= 0x846CA68B;
+		h ^= h >> 16;
+	}
+
+	return h;
+}
+
+// size of a chunk, the last ones may be cut by the map borders
+static void gen_chunk_size(struct l_map *map, int cx, int cy, int *w, int *h)
+{
+	*w = SDL_min(MAP_CHUNK_TILES, map->width - cx * MAP_CHUNK_TILES);
+	*h = SDL_min(MAP_CHUNK_TILES, map->height - cy * MAP_CHUNK_TILES);
+}
+
+// door position along the border after chunk cx,cy, shared by both chunks so
+// their corridors meet
+static int gen_door(uint32_t seed, int cx, int cy, int vertical, int len)
+{
+	int margin = len >= 2 * GEN_ROOM_MARGIN + GEN_CORRIDOR_WIDTH ?
+			     GEN_ROOM_MARGIN :
+			     0;
+	int range = len - 2 * margin - GEN_CORRIDOR_WIDTH + 1;
+
+	if (range < 1)
+		return 0;
+	return margin + map_hash(seed, 1 + vertical, cx, cy) % range;
+}
+
+// room of a chunk, only a corridor crossing in one chunk out of five but the
+// starting one. Chunks too small for a room are all floor
+static void gen_room(uint32_t seed, int cx, int cy, int w, int h,
+		     SDL_Rect *room)
+{
+	int max_w = w - 2 * GEN_ROOM_MARGIN;
+	int max_h = h - 2 * GEN_ROOM_MARGIN;
+	uint32_t r = map_hash(seed, 0, cx, cy);
+
+	if (max_w < GEN_ROOM_MIN || max_h < GEN_ROOM_MIN) {
+		*room = (SDL_Rect){ 0, 0, w, h };
+		return;
+	}
+
+	if (r % 5 == 0 && (cx || cy)) {
+		room->w = GEN_CORRIDOR_WIDTH;
+		room->h = GEN_CORRIDOR_WIDTH;
+	} else {
+		room->w = GEN_ROOM_MIN + (r >> 4) % (max_w - GEN_ROOM_MIN + 1);
+		room->h = GEN_ROOM_MIN + (r >> 12) % (max_h - GEN_ROOM_MIN + 1);
+	}
+	room->x = GEN_ROOM_MARGIN + (r >> 20) % (max_w - room->w + 1);
+	room->y = GEN_ROOM_MARGIN + (r >> 26) % (max_h - room->h + 1);
+
+	// the top left corner is kept free to start from
+	if (!cx && !cy)
+		room->x = room->y = 0;
+}
+
+// carve a corridor from x0,y0 to x1,y1 along one axis, clipped to the chunk
+static void gen_corridor(uint8_t *floor, int w, int h, int x0, int y0, int x1,
+			 int y1)
+{
+	int xmax = SDL_min(SDL_max(x0, x1) + GEN_CORRIDOR_WIDTH, w);
+	int ymax = SDL_min(SDL_max(y0, y1) + GEN_CORRIDOR_WIDTH, h);
+
+	for (int y = SDL_min(y0, y1); y < ymax; y++)
+		for (int x = SDL_min(x0, x1); x < xmax; x++)
+			if (floor[y * MAP_CHUNK_TILES + x] == GEN_ROCK)
+				floor[y * MAP_CHUNK_TILES + x] = GEN_CORRIDOR;
+}
+
+// carve the room of a chunk and the corridors from it to the doors shared
+// with its neighbours. Only depends on the seed and the chunk position, so a
+// chunk can carve its neighbours to know their borders. Outside of the map is
+// rock
+static void gen_carve(struct l_map *map, uint32_t seed, int cx, int cy,
+		      uint8_t *floor, SDL_Rect *room)
+{
+	int w, h, ox, oy, d;
+
+	memset(floor, GEN_ROCK, MAP_CHUNK_SIZE);
+	if (cx < 0 || cy < 0 || cx >= map->chunks_x || cy >= map->chunks_y)
+		return;
+
+	gen_chunk_size(map, cx, cy, &w, &h);
+	gen_room(seed, cx, cy, w, h, room);
+	for (int y = room->y; y < room->y + room->h; y++)
+		memset(&floor[y * MAP_CHUNK_TILES + room->x], GEN_ROOM,
+		       room->w);
+
+	// corridors go straight from the doors, then turn to the room
+	ox = room->x + SDL_max(room->w - GEN_CORRIDOR_WIDTH, 0) / 2;
+	oy = room->y + SDL_max(room->h - GEN_CORRIDOR_WIDTH, 0) / 2;
+	if (cx > 0) {
+		d = gen_door(seed, cx - 1, cy, 1, h);
+		gen_corridor(floor, w, h, 0, d, ox, d);
+		gen_corridor(floor, w, h, ox, d, ox, oy);
+	}
+	if (cx < map->chunks_x - 1) {
+		d = gen_door(seed, cx, cy, 1, h);
+		gen_corridor(floor, w, h, ox, d, w - 1, d);
+		gen_corridor(floor, w, h, ox, d, ox, oy);
+	}
+	if (cy > 0) {
+		d = gen_door(seed, cx, cy - 1, 0, w);
+		gen_corridor(floor, w, h, d, 0, d, oy);
+		gen_corridor(floor, w, h, d, oy, ox, oy);
+	}
+	if (cy < map->chunks_y - 1) {
+		d = gen_door(seed, cx, cy, 0, w);
+		gen_corridor(floor, w, h, d, oy, d, h - 1);
+		gen_corridor(floor, w, h, d, oy, ox, oy);
+	}
+}
+
+// x and y may be one tile out of the chunk, in its neighbours
+static inline int gen_is_floor(uint8_t floors[9][MAP_CHUNK_SIZE], int x,
+			       int y)
+{
+	int i = x < 0 ? 0 : x < MAP_CHUNK_TILES ? 1 : 2;
+	int j = y < 0 ? 0 : y < MAP_CHUNK_TILES ? 1 : 2;
+
+	return floors[j * 3 + i][(y & MAP_CHUNK_MASK) * MAP_CHUNK_TILES +
+				 (x & MAP_CHUNK_MASK)] != GEN_ROCK;
+}
+
+// wall border facing the floor around
+static uint8_t gen_wall(uint8_t floors[9][MAP_CHUNK_SIZE], int x, int y)
+{
+	int n = gen_is_floor(floors, x, y - 1);
+	int s = gen_is_floor(floors, x, y + 1);
+	int w = gen_is_floor(floors, x - 1, y);
+	int e = gen_is_floor(floors, x + 1, y);
+
+	if (n)
+		return w ? TILE_TOPLEFT : e ? TILE_TOPRIGHT : TILE_TOP;
+	if (s)
+		return w ? TILE_BOTTOMLEFT : e ? TILE_BOTTOMRIGHT : TILE_BOTTOM;
+	if (w)
+		return TILE_LEFT;
+	if (e)
+		return TILE_RIGHT;
+
+	// outer corners
+	if (gen_is_floor(floors, x - 1, y - 1))
+		return TILE_TOPLEFT;
+	if (gen_is_floor(floors, x + 1, y - 1))
+		return TILE_TOPRIGHT;
+	if (gen_is_floor(floors, x - 1, y + 1))
+		return TILE_BOTTOMLEFT;
+	if (gen_is_floor(floors, x + 1, y + 1))
+		return TILE_BOTTOMRIGHT;
+	return TILE_CENTER;
+}
+
+// fill the three layers of one chunk
+static void gen_chunk_job(void *data, int job, int worker)
+{
+	struct l_gen_job *gen = data;
+	struct l_map *map = gen->map;
+	uint8_t floors[9][MAP_CHUNK_SIZE];
+	uint8_t *types[3];
+	SDL_Rect room, neighbour, pool = { 0 };
+	int cx = job % map->chunks_x;
+	int cy = job / map->chunks_x;
+	int w, h, style;
+	uint32_t r;
+
+	for (int j = 0; j < 3; j++)
+		for (int i = 0; i < 3; i++)
+			gen_carve(map, gen->seed, cx + i - 1, cy + j - 1,
+				  floors[j * 3 + i],
+				  i == 1 && j == 1 ? &room : &neighbour);
+	for (int layer = 0; layer < 3; layer++)
+		types[layer] = &map->data[map_tile_index(
+			map, layer, cx * MAP_CHUNK_TILES, cy * MAP_CHUNK_TILES)];
+	gen_chunk_size(map, cx, cy, &w, &h);
+
+	// rooms have a wood, marble, checkered or open floor showing the
+	// background, and a water or lava pool in one out of two
+	r = map_hash(gen->seed, 3, cx, cy);
+	style = r % 4;
+	if (r >> 2 & 1 && room.w >= GEN_ROOM_MIN && room.h >= GEN_ROOM_MIN) {
+		pool.w = 2 + (r >> 8) % (room.w - 5);
+		pool.h = 2 + (r >> 16) % (room.h - 5);
+		pool.x = room.x + 2 + (r >> 24) % (room.w - pool.w - 3);
+		pool.y = room.y + 2 + (r >> 28) % (room.h - pool.h - 3);
+	}
+
+	for (int y = 0; y < MAP_CHUNK_TILES; y++) {
+		for (int x = 0; x < MAP_CHUNK_TILES; x++) {
+			int i = y * MAP_CHUNK_TILES + x;
+			int mx = cx * MAP_CHUNK_TILES + x;
+			int my = cy * MAP_CHUNK_TILES + y;
+			SDL_Point tile = { x, y };
+			uint8_t type;
+
+			// tiles past the map borders are never seen
+			if (x >= w || y >= h) {
+				types[0][i] = types[1][i] = types[2][i] =
+					TILE_EMPTY;
+				continue;
+			}
+
+			types[0][i] = (mx / 2 + my / 2) % 2 ? TILE_SKY :
+							      TILE_MARBLE;
+			types[2][i] = map_hash(gen->seed, 4, mx, my) % 64 ?
+					      TILE_EMPTY :
+					      TILE_WOOD;
+
+			if (floors[4][i] == GEN_ROCK)
+				type = gen_wall(floors, x, y);
+			else if (floors[4][i] == GEN_CORRIDOR)
+				type = TILE_MARBLE;
+			else if (SDL_PointInRect(&tile, &pool))
+				type = r >> 3 & 1 ? TILE_WATER : TILE_LAVA;
+			else if (style == 2)
+				type = (mx + my) % 2 ? TILE_WOOD : TILE_MARBLE;
+			else if (style == 3)
+				// the background shows through the sky tiles
+				type = (mx + my) % 3 == TILE_SKY ?
+					       TILE_EMPTY :
+					       (mx + my) % 3;
+			else
+				type = style;
+			types[1][i] = type;
+		}
+	}
+}
+
+// generate a map of the given size with three layers:
+// - a far background, scrolling at half the camera speed,
+// - one room per chunk, joined to the rooms of the neighbour chunks by
+//   corridors through walls, the top left corner being kept free to start
+//   from,
+// - a foreground overlay of scattered tiles, not cached.
+// Chunks are generated in parallel, each one only depends on the seed and its
+// position so maps are the same whatever the number of workers
+static int map_generate(struct l_map *map, struct l_workers *workers,
+			int width, int height, uint32_t seed)
+{
+	struct l_gen_job job = { .map = map, .seed = seed };
+	Uint64 start = SDL_GetPerformanceCounter();
+
+	map_set_size(map, width, height, 3, TILE_WIDTH, TILE_HEIGHT);
+	map->layers[0].flags = LAYER_STATIC;
+	map->layers[0].parallax = LAYER_PARALLAX_ONE / 2;
+	map->layers[1].flags = LAYER_STATIC | LAYER_COLLISION;
+	map->layers[2].flags = 0;
+	map->collision_layer = 1;
+	map->mapping = NULL;
+	map->data = malloc(map_data_size(map));
+	if (map->data == NULL) {
+		printf("Failed to alloc %dx%d map!\n", width, height);
+		return -ENOMEM;
+	}
+
+	workers_run(workers, gen_chunk_job, &job, map->layer_chunks);
+	printf("Generated %dx%d map in %.1f ms\n", width, height,
+	       (double)(SDL_GetPerformanceCounter() - start) * 1000.0 /
+		       SDL_GetPerformanceFrequency());
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////
+// level streaming functions
+///////////////////////////////////////////////////////
+
+// tile types of a chunk
+static inline uint8_t *chunk_types(struct l_map *map, int id)
+{
+	return &map->data[(size_t)id * MAP_CHUNK_SIZE];
+}
+
+static inline int tile_is_wall(int type)
+{
+	return type >= TILE_CENTER && type <= TILE_TOPLEFT;
+}
+
+// Read the tiles of a chunk of a binary map into an anonymous page, which
+// the file cannot change while the chunk is resident: a private file page
+// still shows writes to the file until it is written, and faults once the
+// file is truncated. A chunk cut by a truncated file is left empty, the
+// reload following the write reads it again.
+static void chunk_read(struct l_map *map, int id)
+{
+	uint8_t *types = chunk_types(map, id);
+	ssize_t n;
+
+	if (mmap(types, MAP_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS, -1,
+		 0) == MAP_FAILED) {
+		printf("Failed to mmap chunk #%d: %s\n", id, strerror(errno));
+		return;
+	}
+
+	n = pread(map->fd, types, MAP_CHUNK_SIZE,
+		  MAP_DATA_OFFSET + (off_t)id * MAP_CHUNK_SIZE);
+	if (n < MAP_CHUNK_SIZE) {
+		n = SDL_max(n, 0);
+		memset(types + n, TILE_EMPTY, MAP_CHUNK_SIZE - n);
+	}
+}
+
+// fill the part of the wall bitmap of a chunk from its tiles
+static void chunk_scan(struct l_map *map, uint64_t *walls, int id)
+{
+	uint8_t *types = chunk_types(map, id);
+	int index = id % map->layer_chunks;
+	int cx = index % map->chunks_x;
+	int cy = index / map->chunks_x;
+	int collision = id / map->layer_chunks == map->collision_layer;
+	int invalid = 0;
+
+	for (int y = 0; y < MAP_CHUNK_TILES; y++) {
+		uint64_t word = 0;
+
+		for (int x = 0; x < MAP_CHUNK_TILES; x++) {
+			uint8_t type = types[y * MAP_CHUNK_TILES + x];
+
+			if (type >= TOTAL_TILE_SPRITES && type != TILE_EMPTY)
+				invalid++;
+			word |= (uint64_t)tile_is_wall(type) << x;
+		}
+		if (collision)
+			walls[((size_t)cy * MAP_CHUNK_TILES + y) *
+				      map->chunks_x +
+			      cx] = word;
+	}
+
+	if (invalid)
+		printf("chunk #%d has %d invalid tile types\n", id, invalid);
+}
+
+static uint64_t hash_words(const uint64_t *words, size_t nb_words,
+			   size_t stride)
+{
+	uint64_t h = 0;
+
+	for (size_t i = 0; i < nb_words; i++) {
+		h ^= words[i * stride];
+		h *= 0x9E3779B97F4A7C15ull;
+		h ^= h >> 29;
+	}
+
+	// 0 is left for unknown content
+	return h | 1;
+}
+
+static uint64_t chunk_tiles_hash(struct l_map *map, int id)
+{
+	return hash_words((uint64_t *)chunk_types(map, id),
+			  MAP_CHUNK_SIZE / sizeof(uint64_t), 1);
+}
+
+// hash of the wall bitmap words of a chunk of a layer, one per tile row
+static uint64_t chunk_walls_hash(struct l_map *map, uint64_t *walls,
+				 int index)
+{
+	int cx = index % map->chunks_x, cy = index / map->chunks_x;
+
+	return hash_words(&walls[(size_t)cy * MAP_CHUNK_TILES * map->chunks_x +
+				 cx],
+			  MAP_CHUNK_TILES, map->chunks_x);
+}
+
+// read the chunk tiles, so the main thread does not wait for the disk when
+// reading them, and fill its part of the wall bitmap
+static void chunk_load(struct l_map *map, uint64_t *walls, int id)
+{
+	if (map->mapping)
+		chunk_read(map, id);
+	chunk_scan(map, walls, id);
+}
+
+// map chunks first to last of a binary map from its file again, dropping
+// their pages
+static void chunk_unload(struct l_map *map, int first, int last)
+{
+	size_t len = (size_t)(last - first + 1) * MAP_CHUNK_SIZE;
+
+	if (map->mapping &&
+	    mmap(chunk_types(map, first), len, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_FIXED, map->fd,
+		 MAP_DATA_OFFSET + (off_t)first * MAP_CHUNK_SIZE) == MAP_FAILED)
+		printf("Failed to mmap chunks #%d-%d: %s\n", first, last,
+		       strerror(errno));
+}
+
+// camera of a layer, moved according to the layer parallax
+static void layer_camera(struct l_map *map, int layer, SDL_Rect *camera,
+			 SDL_Rect *layer_cam)
+{
+	*layer_cam = *camera;
+	layer_cam->x = camera->x * map->layers[layer].parallax /
+		       LAYER_PARALLAX_ONE;
+	layer_cam->y = camera->y * map->layers[layer].parallax /
+		       LAYER_PARALLAX_ONE;
+}
+
+static inline int chunk_range_empty(struct l_tile_range *range)
+{
+	return range->col_min > range->col_max ||
+	       range->row_min > range->row_max;
+}
+
+// chunks overlapped by a rectangle given in level coordinates
+static int level_chunk_range(struct l_level *level, SDL_Rect *rect,
+			     struct l_tile_range *range)
+{
+	if (!map_tile_range(level->map, rect, range))
+		return 0;
+
+	range->col_min >>= MAP_CHUNK_SHIFT;
+	range->col_max >>= MAP_CHUNK_SHIFT;
+	range->row_min >>= MAP_CHUNK_SHIFT;
+	range->row_max >>= MAP_CHUNK_SHIFT;
+
+	return 1;
+}
+
+// grow a chunk range by the given number of chunks on each side, within the
+// map
+static void chunk_range_grow(struct l_level *level, struct l_tile_range *range,
+			     int left, int right, int up, int down)
+{
+	range->col_min = SDL_max(range->col_min - left, 0);
+	range->col_max = SDL_min(range->col_max + right,
+				 level->map->chunks_x - 1);
+	range->row_min = SDL_max(range->row_min - up, 0);
+	range->row_max = SDL_min(range->row_max + down,
+				 level->map->chunks_y - 1);
+}
+
+// chunks prefetched in the moving direction, and chunks kept around
+static void stream_windows(struct l_level *level, struct l_tile_range *request,
+			   int dir_x, int dir_y, struct l_tile_range *ahead,
+			   struct l_tile_range *around)
+{
+	*ahead = *request;
+	chunk_range_grow(level, ahead,
+			 dir_x < 0 ? STREAM_LOOKAHEAD : 0,
+			 dir_x > 0 ? STREAM_LOOKAHEAD : 0,
+			 dir_y < 0 ? STREAM_LOOKAHEAD : 0,
+			 dir_y > 0 ? STREAM_LOOKAHEAD : 0);
+
+	*around = *request;
+	chunk_range_grow(level, around, STREAM_MARGIN, STREAM_MARGIN,
+			 STREAM_MARGIN, STREAM_MARGIN);
+}
+
+// first unloaded chunk of a layer range, -1 if none. Called with the lock
+// held.
+static int stream_find_unloaded(struct l_level *level, int layer,
+				struct l_tile_range *range)
+{
+	for (int cy = range->row_min; cy <= range->row_max; cy++) {
+		for (int cx = range->col_min; cx <= range->col_max; cx++) {
+			int id = layer * level->map->layer_chunks +
+				 cy * level->map->chunks_x + cx;
+
+			if (level->chunk_state[id] == CHUNK_UNLOADED)
+				return id;
+		}
+	}
+	return -1;
+}
+
+// next chunk to load: the ones seen by the layer cameras first, then the
+// ones ahead of them and finally the ones around. Called with the lock held.
+static int stream_next_chunk(struct l_level *level)
+{
+	struct l_tile_range ahead[MAP_MAX_LAYERS], around[MAP_MAX_LAYERS];
+	int layer_count = level->map->layer_count;
+	int id = -1;
+
+	for (int l = 0; l < layer_count && id < 0; l++) {
+		if (chunk_range_empty(&level->stream_request[l]))
+			continue;
+		stream_windows(level, &level->stream_request[l],
+			       level->stream_dir_x, level->stream_dir_y,
+			       &ahead[l], &around[l]);
+		id = stream_find_unloaded(level, l, &level->stream_request[l]);
+	}
+	for (int l = 0; l < layer_count && id < 0; l++)
+		if (!chunk_range_empty(&level->stream_request[l]))
+			id = stream_find_unloaded(level, l, &ahead[l]);
+	for (int l = 0; l < layer_count && id < 0; l++)
+		if (!chunk_range_empty(&level->stream_request[l]))
+			id = stream_find_unloaded(level, l, &around[l]);
+
+	return id;
+}
+
+static int level_stream_thread(void *data)
+{
+	struct l_level *level = data;
+
+	SDL_LockMutex(level->lock);
+	while (!level->quit) {
+		int id = -1;
+
+		if (level->nb_loaded < STREAM_QUEUE_SIZE)
+			id = stream_next_chunk(level);
+		if (id < 0) {
+			// nothing to do until the camera moves
+			SDL_CondWait(level->request_cond, level->lock);
+			continue;
+		}
+
+		level->chunk_state[id] = CHUNK_LOADING;
+		SDL_UnlockMutex(level->lock);
+
+		// page faults happen out of the main thread
+		chunk_load(level->map, level->walls, id);
+
+		SDL_LockMutex(level->lock);
+		level->loaded[level->nb_loaded++] = id;
+		level->chunk_state[id] = CHUNK_LOADED;
+		SDL_CondBroadcast(level->loaded_cond);
+	}
+	SDL_UnlockMutex(level->lock);
+
+	return 0;
+}
+
+// compare the tiles and walls of a chunk made resident or reloaded with the
+// ones it had when last resident. Baked textures over it are only dropped if
+// its tiles changed, and the collision layer versions only bumped if its
+// tiles or walls changed. A stale chunk never resident before may have
+// changed on the minimap.
+static void level_chunk_check(struct l_level *level, int id, int stale)
+{
+	struct l_map *map = level->map;
+	int index = id % map->layer_chunks;
+	int collision = id / map->layer_chunks == map->collision_layer;
+	uint64_t tiles = chunk_tiles_hash(map, id);
+	uint64_t walls;
+
+	if (level->tiles_hash[id] ? tiles != level->tiles_hash[id] : stale) {
+		bake_cache_invalidate_chunk(map, id);
+		if (collision)
+			level->tiles_version[index]++;
+	}
+	level->tiles_hash[id] = tiles;
+
+	if (!collision)
+		return;
+	walls = chunk_walls_hash(map, level->walls, index);
+	if (level->walls_hash[index] && walls != level->walls_hash[index])
+		level->walls_version[index]++;
+	level->walls_hash[index] = walls;
+}
+
+static int level_add_resident(struct l_level *level, int id)
+{
+	if (level->nb_resident == level->resident_size) {
+		int size = level->resident_size ? level->resident_size * 2 : 64;
+		int *resident = realloc(level->resident,
+					size * sizeof(*resident));
+
+		if (resident == NULL)
+			return -ENOMEM;
+		level->resident = resident;
+		level->resident_size = size;
+	}
+
+	// may have been loaded before the new file replaced the old one
+	if (level->chunk_stale[id])
+		chunk_load(level->map, level->walls, id);
+	level_chunk_check(level, id, level->chunk_stale[id]);
+	level->chunk_stale[id] = 0;
+
+	level->resident[level->nb_resident++] = id;
+	level->chunk_types[id] = chunk_types(level->map, id);
+	level->chunk_state[id] = CHUNK_RESIDENT;
+
+	return 0;
+}
+
+// hand the chunks loaded by the streaming thread to the main thread. Called
+// with the lock held.
+static void level_drain_loaded(struct l_level *level)
+{
+	for (int i = 0; i < level->nb_loaded; i++) {
+		int id = level->loaded[i];
+
+		if (level_add_resident(level, id) < 0)
+			level->chunk_state[id] = CHUNK_UNLOADED;
+	}
+	level->nb_loaded = 0;
+}
+
+// make a chunk resident now, waiting for the streaming thread if it is
+// loading it. Only needed when streaming is late.
+static int level_require_chunk(struct l_level *level, int id)
+{
+	int ret = 0;
+
+	if (level->chunk_types[id])
+		return 0;
+
+	SDL_LockMutex(level->lock);
+	while (!level->chunk_types[id]) {
+		level_drain_loaded(level);
+		if (level->chunk_types[id])
+			break;
+
+		if (level->chunk_state[id] != CHUNK_UNLOADED) {
+			SDL_CondWait(level->loaded_cond, level->lock);
+			continue;
+		}
+
+		level->chunk_state[id] = CHUNK_LOADING;
+		SDL_UnlockMutex(level->lock);
+		chunk_load(level->map, level->walls, id);
+		SDL_LockMutex(level->lock);
+
+		if (level_add_resident(level, id) < 0) {
+			level->chunk_state[id] = CHUNK_UNLOADED;
+			ret = -ENOMEM;
+			break;
+		}
+	}
+	SDL_UnlockMutex(level->lock);
+
+	return ret;
+}
+
+// Copy tile rows y0 to y1 of a chunk: from the level if it is resident, else
+// from the map file, since the streaming thread swaps the page of a chunk it
+// loads, and file pages fault while the file is truncated. Safe from any
+// thread.
+static void level_read_rows(struct l_level *level, int id, int y0, int y1,
+			    uint8_t *rows)
+{
+	struct l_map *map = level->map;
+	size_t offset = (size_t)y0 * MAP_CHUNK_TILES;
+	size_t len = (size_t)(y1 - y0 + 1) * MAP_CHUNK_TILES;
+	int done = 0;
+	ssize_t n;
+
+	SDL_LockMutex(level->lock);
+	if (level->chunk_types[id] || !map->mapping) {
+		memcpy(rows, chunk_types(map, id) + offset, len);
+		done = 1;
+	}
+	SDL_UnlockMutex(level->lock);
+	if (done)
+		return;
+
+	n = pread(map->fd, rows, len,
+		  MAP_DATA_OFFSET + (off_t)id * MAP_CHUNK_SIZE + offset);
+	if (n < (ssize_t)len) {
+		n = SDL_max(n, 0);
+		memset(rows + n, TILE_EMPTY, len - n);
+	}
+}
+
+// make the chunks of a layer overlapped by a rectangle resident
+static int level_require_rect(struct l_level *level, int layer, SDL_Rect *rect)
+{
+	struct l_tile_range range;
+	int ret;
+
+	if (!level_chunk_range(level, rect, &range))
+		return 0;
+
+	for (int cy = range.row_min; cy <= range.row_max; cy++) {
+		for (int cx = range.col_min; cx <= range.col_max; cx++) {
+			ret = level_require_chunk(
+				level, layer * level->map->layer_chunks +
+					       cy * level->map->chunks_x + cx);
+			if (ret < 0)
+				return ret;
+		}
+	}
+	return 0;
+}
+
+// make the chunks of every layer seen by the camera resident
+static int level_require_camera(struct l_level *level, SDL_Rect *camera)
+{
+	SDL_Rect layer_cam;
+	int ret;
+
+	for (int l = 0; l < level->map->layer_count; l++) {
+		layer_camera(level->map, l, camera, &layer_cam);
+		ret = level_require_rect(level, l, &layer_cam);
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
+
+// type of the tile of a layer at the given tile coordinates, TILE_NONE if
+// its chunk is not resident
+static inline int level_tile_type(struct l_level *level, int layer, int x,
+				  int y)
+{
+	uint8_t *types =
+		level->chunk_types[layer * level->map->layer_chunks +
+				   (y >> MAP_CHUNK_SHIFT) * level->map->chunks_x +
+				   (x >> MAP_CHUNK_SHIFT)];
+
+	if (types == NULL)
+		return TILE_NONE;
+
+	return types[((y & MAP_CHUNK_MASK) << MAP_CHUNK_SHIFT) +
+		     (x & MAP_CHUNK_MASK)];
+}
+
+// request the chunks around the layer cameras, prefetching in the moving
+// direction, and free the ones out of reach
+static void level_stream_update(struct l_level *level, SDL_Rect *camera,
+				int vel_x, int vel_y)
+{
+	struct l_tile_range ahead, around, keep[MAP_MAX_LAYERS];
+	struct l_map *map = level->map;
+	int evicted = 0;
+
+	level->dir_x = (vel_x > 0) - (vel_x < 0);
+	level->dir_y = (vel_y > 0) - (vel_y < 0);
+
+	for (int l = 0; l < map->layer_count; l++) {
+		SDL_Rect layer_cam;
+
+		layer_camera(map, l, camera, &layer_cam);
+		if (!level_chunk_range(level, &layer_cam, &level->request[l])) {
+			// layer out of sight, nothing requested or kept
+			level->request[l].col_min = 1;
+			level->request[l].col_max = 0;
+			keep[l] = level->request[l];
+			continue;
+		}
+
+		// chunks kept are the streamed ones plus one more chunk, so
+		// going back and forth over a chunk border does not reload
+		// chunks
+		stream_windows(level, &level->request[l], level->dir_x,
+			       level->dir_y, &ahead, &around);
+		keep[l].col_min = SDL_min(ahead.col_min, around.col_min);
+		keep[l].col_max = SDL_max(ahead.col_max, around.col_max);
+		keep[l].row_min = SDL_min(ahead.row_min, around.row_min);
+		keep[l].row_max = SDL_max(ahead.row_max, around.row_max);
+		chunk_range_grow(level, &keep[l], 1, 1, 1, 1);
+	}
+
+	SDL_LockMutex(level->lock);
+	level_drain_loaded(level);
+	memcpy(level->stream_request, level->request,
+	       sizeof(level->stream_request));
+	level->stream_dir_x = level->dir_x;
+	level->stream_dir_y = level->dir_y;
+	SDL_CondSignal(level->request_cond);
+
+	for (int i = 0; i < level->nb_resident &&
+			evicted < STREAM_EVICT_BUDGET;) {
+		int id = level->resident[i];
+		struct l_tile_range *k = &keep[id / map->layer_chunks];
+		int cx = id % map->layer_chunks % map->chunks_x;
+		int cy = id % map->layer_chunks / map->chunks_x;
+
+		if (cx >= k->col_min && cx <= k->col_max &&
+		    cy >= k->row_min && cy <= k->row_max) {
+			i++;
+			continue;
+		}
+
+		chunk_unload(map, id, id);
+		level->chunk_types[id] = NULL;
+		level->chunk_state[id] = CHUNK_UNLOADED;
+		level->resident[i] = level->resident[--level->nb_resident];
+		evicted++;
+	}
+	SDL_UnlockMutex(level->lock);
+}
+
+static int level_init(struct l_level *level, struct l_map *map)
+{
+	size_t nb_chunks = (size_t)map->layer_chunks * map->layer_count;
+
+	memset(level, 0, sizeof(*level));
+	level->map = map;
+	// nothing requested yet
+	for (int l = 0; l < MAP_MAX_LAYERS; l++) {
+		level->request[l].col_min = 1;
+		level->stream_request[l].col_min = 1;
+	}
+
+	level->chunk_types = calloc(nb_chunks, sizeof(*level->chunk_types));
+	level->chunk_stale = calloc(nb_chunks, sizeof(*level->chunk_stale));
+	level->tiles_hash = calloc(nb_chunks, sizeof(*level->tiles_hash));
+	level->walls_hash = calloc(map->layer_chunks,
+				   sizeof(*level->walls_hash));
+	level->walls_version = calloc(map->layer_chunks,
+				      sizeof(*level->walls_version));
+	level->tiles_version = calloc(map->layer_chunks,
+				      sizeof(*level->tiles_version));
+	level->chunk_state = calloc(nb_chunks, sizeof(*level->chunk_state));
+	// zeroed pages are only backed once chunks around them are loaded
+	level->walls = calloc((size_t)map->layer_chunks * MAP_CHUNK_TILES,
+			      sizeof(*level->walls));
+	level->lock = SDL_CreateMutex();
+	level->request_cond = SDL_CreateCond();
+	level->loaded_cond = SDL_CreateCond();
+	if (!level->chunk_types || !level->chunk_stale ||
+	    !level->tiles_hash || !level->walls_hash ||
+	    !level->walls_version || !level->tiles_version ||
+	    !level->chunk_state || !level->walls ||
+	    !level->lock ||
+	    !level->request_cond || !level->loaded_cond) {
+		printf("Failed to alloc level!\n");
+		return -ENOMEM;
+	}
+
+	level->thread = SDL_CreateThread(level_stream_thread, "level_stream",
+					 level);
+	if (!level->thread) {
+		printf("Failed to create streaming thread! SDL Error: %s\n",
+		       SDL_GetError());
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static void level_free(struct l_level *level)
+{
+	if (level->thread) {
+		SDL_LockMutex(level->lock);
+		level->quit = 1;
+		SDL_CondSignal(level->request_cond);
+		SDL_UnlockMutex(level->lock);
+		SDL_WaitThread(level->thread, NULL);
+		level->thread = NULL;
+	}
+
+	free(level->resident);
+	free(level->chunk_types);
+	free(level->chunk_stale);
+	free(level->tiles_hash);
+	free(level->walls_hash);
+	free(level->walls_version);
+	free(level->tiles_version);
+	free(level->chunk_state);
+	free(level->walls);
+	if (level->loaded_cond)
+		SDL_DestroyCond(level->loaded_cond);
+	if (level->request_cond)
+		SDL_DestroyCond(level->request_cond);
+	if (level->lock)
+		SDL_DestroyMutex(level->lock);
+	memset(level, 0, sizeof(*level));
+}
+
+static void texture_render(struct l_texture *t, int x, int y, SDL_Rect *clip)
+{
+	// Set rendering space and render to screen
+	SDL_Rect render_quad = { x, y, t->width, t->height };
+
+	// Set clip rendering dimensions
+	if (clip != NULL) {
+		render_quad.w = clip->w;
+		render_quad.h = clip->h;
+	}
+
+	SDL_RenderCopyEx(g_renderer, t->texture, clip, &render_quad, 0, NULL,
+			 0);
+}
+
+static int load_media(struct l_map *map)
+{
+	int ret;
+
+	// load character
+	ret = load_ltexture_from_file(PATH_TO_LION, &g_mo_texture);
+	if (ret < 0) {
+		printf("Failed to load lion texture image!\n");
+		return ret;
+	}
+	// load tile sheet
+	ret = tiles_load_lods(PATH_TO_TILES);
+	if (ret < 0) {
+		printf("Failed to load tiles texture image!\n");
+		return ret;
+	}
+	// tile sheet clips are cut for the default tile size
+	if (map->tile_w != TILE_WIDTH || map->tile_h != TILE_HEIGHT) {
+		printf("Map tile size %dx%d does not match tile sheet!\n",
+		       map->tile_w, map->tile_h);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static void leave()
+{
+	// free loaded images
+	free_ltexture(&g_mo_texture);
+	bake_cache_free();
+	tile_batch_free(&g_tile_batch);
+	tile_batch_free(&g_bake_batch);
+	//free_ltexture(&background_texture);
+
+	// destroy g_window
+	SDL_DestroyRenderer(g_renderer);
+	SDL_DestroyWindow(g_window);
+	g_renderer = NULL;
+	g_window = NULL;
+
+	//quit subsystems
+	IMG_Quit();
+	SDL_Quit();
+}
+
+static void tile_clips_init()
+{
+	g_tile_clips[TILE_WOOD].x = 0;
+	g_tile_clips[TILE_WOOD].y = 0;
+	g_tile_clips[TILE_WOOD].w = TILE_WIDTH;
+	g_tile_clips[TILE_WOOD].h = TILE_HEIGHT;
+
+	g_tile_clips[TILE_MARBLE].x = 0;
+	g_tile_clips[TILE_MARBLE].y = 80;
+	g_tile_clips[TILE_MARBLE].w = TILE_WIDTH;
+	g_tile_clips[TILE_MARBLE].h = TILE_HEIGHT;
+
+	g_tile_clips[TILE_SKY].x = 0;
+	g_tile_clips[TILE_SKY].y = 160;
+	g_tile_clips[TILE_SKY].w = TILE_WIDTH;
+	g_tile_clips[TILE_SKY].h = TILE_HEIGHT;
+
+	g_tile_clips[TILE_TOPLEFT].x = 80;
+	g_tile_clips[TILE_TOPLEFT].y = 0;
+	g_tile_clips[TILE_TOPLEFT].w = TILE_WIDTH;
+	g_tile_clips[TILE_TOPLEFT].h = TILE_HEIGHT;
+
+	g_tile_clips[TILE_LEFT].x = 80;
+	g_tile_clips[TILE_LEFT].y = 80;
+	g_tile_clips[TILE_LEFT].w = TILE_WIDTH;
+	g_tile_clips[TILE_LEFT].h = TILE_HEIGHT;
+
+	g_tile_clips[TILE_BOTTOMLEFT].x = 80;
+	g_tile_clips[TILE_BOTTOMLEFT].y = 160;
+	g_tile_clips[TILE_BOTTOMLEFT].w = TILE_WIDTH;
+	g_tile_clips[TILE_BOTTOMLEFT].h = TILE_HEIGHT;
+
+	g_tile_clips[TILE_TOP].x = 160;
+	g_tile_clips[TILE_TOP].y = 0;
+	g_tile_clips[TILE_TOP].w = TILE_WIDTH;
+	g_tile_clips[TILE_TOP].h = TILE_HEIGHT;
+
+	g_tile_clips[TILE_CENTER].x = 160;
+	g_tile_clips[TILE_CENTER].y = 80;
+	g_tile_clips[TILE_CENTER].w = TILE_WIDTH;
+	g_tile_clips[TILE_CENTER].h = TILE_HEIGHT;
+
+	g_tile_clips[TILE_BOTTOM].x = 160;
+	g_tile_clips[TILE_BOTTOM].y = 160;
+	g_tile_clips[TILE_BOTTOM].w = TILE_WIDTH;
+	g_tile_clips[TILE_BOTTOM].h = TILE_HEIGHT;
+
+	g_tile_clips[TILE_TOPRIGHT].x = 240;
+	g_tile_clips[TILE_TOPRIGHT].y = 0;
+	g_tile_clips[TILE_TOPRIGHT].w = TILE_WIDTH;
+	g_tile_clips[TILE_TOPRIGHT].h = TILE_HEIGHT;
+
+	g_tile_clips[TILE_RIGHT].x = 240;
+	g_tile_clips[TILE_RIGHT].y = 80;
+	g_tile_clips[TILE_RIGHT].w = TILE_WIDTH;
+	g_tile_clips[TILE_RIGHT].h = TILE_HEIGHT;
+
+	g_tile_clips[TILE_BOTTOMRIGHT].x = 240;
+	g_tile_clips[TILE_BOTTOMRIGHT].y = 160;
+	g_tile_clips[TILE_BOTTOMRIGHT].w = TILE_WIDTH;
+	g_tile_clips[TILE_BOTTOMRIGHT].h = TILE_HEIGHT;
+
+	// animated tiles start on their first frame
+	for (int i = 0; i < TOTAL_TILE_ANIMS; i++) {
+		struct l_tile_anim *anim = &g_tile_anims[i];
+
+		g_tile_animated[anim->type] = 1;
+		g_tile_clips[anim->type].x = anim->x;
+		g_tile_clips[anim->type].y = anim->y;
+		g_tile_clips[anim->type].w = TILE_WIDTH;
+		g_tile_clips[anim->type].h = TILE_HEIGHT;
+	}
+}
+
+// move animated tile clips to the frame of the given time, in milliseconds
+static void tile_anims_update(Uint32 ms)
+{
+	for (int i = 0; i < TOTAL_TILE_ANIMS; i++) {
+		struct l_tile_anim *anim = &g_tile_anims[i];
+		int frame = ms / anim->frame_ms % anim->nb_frames;
+
+		g_tile_clips[anim->type].x = anim->x + frame * TILE_WIDTH;
+	}
+}
+
+///////////////////////////////////////////////////////
+// collision detection
+///////////////////////////////////////////////////////
+
+static int check_wall_touched(SDL_Rect *box, struct l_level *level)
+{
+	struct l_tile_range range;
+	int stride = level->map->chunks_x;
+	int word_min, word_max;
+	uint64_t mask_min, mask_max;
+
+	// tiles overlapped by the box are found from its coordinates instead of
+	// scanning the whole level
+	if (!map_tile_range(level->map, box, &range))
+		return 0;
+
+	// walls must not be missed because streaming is late
+	level_require_rect(level, level->map->collision_layer, box);
+
+	// bits of the overlapped columns in the first and last words of a row
+	word_min = range.col_min >> MAP_CHUNK_SHIFT;
+	word_max = range.col_max >> MAP_CHUNK_SHIFT;
+	mask_min = ~0ULL << (range.col_min & MAP_CHUNK_MASK);
+	mask_max = ~0ULL >> (MAP_CHUNK_MASK - (range.col_max & MAP_CHUNK_MASK));
+
+	// a wall tile in the range always overlaps the box
+	for (int row = range.row_min; row <= range.row_max; row++) {
+		uint64_t *walls = &level->walls[(size_t)row * stride];
+
+		if (word_min == word_max) {
+			if (walls[word_min] & mask_min & mask_max)
+				return 1;
+			continue;
+		}
+		if (walls[word_min] & mask_min || walls[word_max] & mask_max)
+			return 1;
+		for (int w = word_min + 1; w < word_max; w++)
+			if (walls[w])
+				return 1;
+	}
+	return 0;
+}
+
+// move a box along the x axis, stopping against the first wall or level
+// border on the way. Only the tile columns entered by its leading side are
+// tested, so the cost follows the distance and not the map size. Returns
+// the distance actually travelled.
+static int level_sweep_x(struct l_level *level, SDL_Rect *box, int dx)
+{
+	int tile_w = level->map->tile_w;
+	int level_w = level->map->width * tile_w;
+	SDL_Rect strip = { .y = box->y, .w = tile_w, .h = box->h };
+	int edge;
+
+	// do not go outside the level
+	if (box->x + dx < 0)
+		dx = -box->x;
+	if (box->x + box->w + dx > level_w)
+		dx = level_w - box->x - box->w;
+
+	if (dx > 0) {
+		// first pixel column on the right of the box
+		edge = box->x + box->w;
+		for (int col = edge / tile_w; col * tile_w < edge + dx; col++) {
+			strip.x = col * tile_w;
+			if (check_wall_touched(&strip, level))
+				return SDL_max(strip.x - edge, 0);
+		}
+	} else if (dx < 0) {
+		edge = box->x;
+		for (int col = (edge - 1) / tile_w; col >= (edge + dx) / tile_w;
+		     col--) {
+			strip.x = col * tile_w;
+			if (check_wall_touched(&strip, level))
+				return SDL_min(strip.x + tile_w - edge, 0);
+		}
+	}
+
+	return dx;
+}
+
+// same as level_sweep_x() along the y axis
+static int level_sweep_y(struct l_level *level, SDL_Rect *box, int dy)
+{
+	int tile_h = level->map->tile_h;
+	int level_h = level->map->height * tile_h;
+	SDL_Rect strip = { .x = box->x, .w = box->w, .h = tile_h };
+	int edge;
+
+	// do not go outside the level
+	if (box->y + dy < 0)
+		dy = -box->y;
+	if (box->y + box->h + dy > level_h)
+		dy = level_h - box->y - box->h;
+
+	if (dy > 0) {
+		// first pixel row under the box
+		edge = box->y + box->h;
+		for (int row = edge / tile_h; row * tile_h < edge + dy; row++) {
+			strip.y = row * tile_h;
+			if (check_wall_touched(&strip, level))
+				return SDL_max(strip.y - edge, 0);
+		}
+	} else if (dy < 0) {
+		edge = box->y;
+		for (int row = (edge - 1) / tile_h; row >= (edge + dy) / tile_h;
+		     row--) {
+			strip.y = row * tile_h;
+			if (check_wall_touched(&strip, level))
+				return SDL_min(strip.y + tile_h - edge, 0);
+		}
+	}
+
+	return dy;
+}
+
+///////////////////////////////////////////////////////
+// worker functions
+///////////////////////////////////////////////////////
+
+// run the jobs of the current batch until none is left
+static void workers_work(struct l_workers *workers, int index)
+{
+	SDL_LockMutex(workers->lock);
+	while (workers->next < workers->nb_jobs) {
+		int job = workers->next++;
+
+		SDL_UnlockMutex(workers->lock);
+		workers->func(workers->data, job, index);
+		SDL_LockMutex(workers->lock);
+
+		if (++workers->nb_done == workers->nb_jobs)
+			SDL_CondSignal(workers->done_cond);
+	}
+	SDL_UnlockMutex(workers->lock);
+}
+
+static int worker_thread(void *data)
+{
+	struct l_worker *worker = data;
+	struct l_workers *workers = worker->workers;
+
+	SDL_LockMutex(workers->lock);
+	while (!workers->quit) {
+		if (workers->next >= workers->nb_jobs) {
+			SDL_CondWait(workers->work_cond, workers->lock);
+			continue;
+		}
+		SDL_UnlockMutex(workers->lock);
+		workers_work(workers, worker->index);
+		SDL_LockMutex(workers->lock);
+	}
+	SDL_UnlockMutex(workers->lock);
+
+	return 0;
+}
+
+// run func for every job of a batch on the worker threads and the calling
+// one, returning once all jobs are done. worker is below nb_workers + 1.
+static void workers_run(struct l_workers *workers,
+			void (*func)(void *data, int job, int worker),
+			void *data, int nb_jobs)
+{
+	if (nb_jobs <= 0)
+		return;
+
+	SDL_LockMutex(workers->lock);
+	workers->func = func;
+	workers->data = data;
+	workers->nb_jobs = nb_jobs;
+	workers->next = 0;
+	workers->nb_done = 0;
+	SDL_CondBroadcast(workers->work_cond);
+	SDL_UnlockMutex(workers->lock);
+
+	workers_work(workers, workers->nb_workers);
+
+	SDL_LockMutex(workers->lock);
+	while (workers->nb_done < workers->nb_jobs)
+		SDL_CondWait(workers->done_cond, workers->lock);
+	workers->nb_jobs = 0;
+	workers->next = 0;
+	SDL_UnlockMutex(workers->lock);
+}
+
+static void workers_free(struct l_workers *workers)
+{
+	if (workers->lock) {
+		SDL_LockMutex(workers->lock);
+		workers->quit = 1;
+		SDL_CondBroadcast(workers->work_cond);
+		SDL_UnlockMutex(workers->lock);
+	}
+	for (int i = 0; i < workers->nb_workers; i++)
+		if (workers->workers[i].thread)
+			SDL_WaitThread(workers->workers[i].thread, NULL);
+
+	if (workers->done_cond)
+		SDL_DestroyCond(workers->done_cond);
+	if (workers->work_cond)
+		SDL_DestroyCond(workers->work_cond);
+	if (workers->lock)
+		SDL_DestroyMutex(workers->lock);
+	memset(workers, 0, sizeof(*workers));
+}
+
+// one worker per core beside the calling thread
+static int workers_init(struct l_workers *workers)
+{
+	memset(workers, 0, sizeof(*workers));
+	workers->lock = SDL_CreateMutex();
+	workers->work_cond = SDL_CreateCond();
+	workers->done_cond = SDL_CreateCond();
+	if (!workers->lock || !workers->work_cond || !workers->done_cond) {
+		printf("Failed to create workers locks! SDL Error: %s\n",
+		       SDL_GetError());
+		workers_free(workers);
+		return -ENOMEM;
+	}
+
+	for (int i = 0; i < SDL_clamp(SDL_GetCPUCount() - 1, 0, MAX_WORKERS);
+	     i++) {
+		struct l_worker *worker = &workers->workers[i];
+
+		worker->workers = workers;
+		worker->index = i;
+		worker->thread = SDL_CreateThread(worker_thread, "worker",
+						  worker);
+		if (!worker->thread) {
+			printf("Failed to create worker! SDL Error: %s\n",
+			       SDL_GetError());
+			workers_free(workers);
+			return -ENOMEM;
+		}
+		workers->nb_workers++;
+	}
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////
+// pathfinding functions
+///////////////////////////////////////////////////////
+
+// tiles searched for a request: the box around its start and goal, grown by
+// a margin. Returns 0 if the window is too large.
+static int path_window(struct l_map *map, struct l_path_request *req,
+		       SDL_Rect *window)
+{
+	int x_min = SDL_max(SDL_min(req->start.x, req->goal.x) - PATH_MARGIN, 0);
+	int y_min = SDL_max(SDL_min(req->start.y, req->goal.y) - PATH_MARGIN, 0);
+	int x_max = SDL_min(SDL_max(req->start.x, req->goal.x) + PATH_MARGIN,
+			    map->width - 1);
+	int y_max = SDL_min(SDL_max(req->start.y, req->goal.y) + PATH_MARGIN,
+			    map->height - 1);
+
+	window->x = x_min;
+	window->y = y_min;
+	window->w = x_max - x_min + 1;
+	window->h = y_max - y_min + 1;
+
+	return window->w <= PATH_MAX_WINDOW && window->h <= PATH_MAX_WINDOW;
+}
+
+// walls are read from the level bitmap, tiles out of the window are walls
+static inline int path_free(struct l_path_search *s, int x, int y)
+{
+	if (x < s->window.x || y < s->window.y ||
+	    x >= s->window.x + s->window.w || y >= s->window.y + s->window.h)
+		return 0;
+
+	return !(s->walls[(size_t)y * s->stride + (x >> MAP_CHUNK_SHIFT)] >>
+		 (x & MAP_CHUNK_MASK) & 1);
+}
+
+static inline int path_node(struct l_path_search *s, int x, int y)
+{
+	return (y - s->window.y) * s->window.w + x - s->window.x;
+}
+
+// octile distance, diagonal moves costing a bit more than straight ones
+static inline uint32_t path_distance(int x0, int y0, int x1, int y1)
+{
+	int dx = abs(x1 - x0), dy = abs(y1 - y0);
+
+	return PATH_COST_STRAIGHT * abs(dx - dy) +
+	       PATH_COST_DIAGONAL * SDL_min(dx, dy);
+}
+
+// follow a straight line from x, y until a tile with a forced neighbour or
+// the goal. Returns 0 if a wall is met first.
+static int path_jump_straight(struct l_path_search *s, int x, int y, int dx,
+			      int dy, SDL_Point *jump)
+{
+	for (;;) {
+		x += dx;
+		y += dy;
+		if (!path_free(s, x, y))
+			return 0;
+		if (x == s->goal.x && y == s->goal.y)
+			break;
+
+		// a wall ending beside the line opens a shorter way
+		if (dx && ((path_free(s, x, y - 1) && !path_free(s, x - dx, y - 1)) ||
+			   (path_free(s, x, y + 1) && !path_free(s, x - dx, y + 1))))
+			break;
+		if (dy && ((path_free(s, x - 1, y) && !path_free(s, x - 1, y - dy)) ||
+			   (path_free(s, x + 1, y) && !path_free(s, x + 1, y - dy))))
+			break;
+	}
+
+	jump->x = x;
+	jump->y = y;
+	return 1;
+}
+
+// jump from x, y in a direction, diagonal moves not cutting wall corners.
+// Returns 0 if no jump point was found.
+static int path_jump(struct l_path_search *s, int x, int y, int dx, int dy,
+		     SDL_Point *jump)
+{
+	SDL_Point straight;
+
+	if (!dx || !dy)
+		return path_jump_straight(s, x, y, dx, dy, jump);
+
+	for (;;) {
+		if (!path_free(s, x + dx, y) || !path_free(s, x, y + dy))
+			return 0;
+		x += dx;
+		y += dy;
+		if (!path_free(s, x, y))
+			return 0;
+
+		// a diagonal stops where one of its straight lines finds a
+		// jump point
+		if ((x == s->goal.x && y == s->goal.y) ||
+		    path_jump_straight(s, x, y, dx, 0, &straight) ||
+		    path_jump_straight(s, x, y, 0, dy, &straight))
+			break;
+	}
+
+	jump->x = x;
+	jump->y = y;
+	return 1;
+}
+
+// directions worth jumping to from a node reached going dx, dy. All of them
+// from the start node.
+static int path_directions(struct l_path_search *s, int x, int y, int dx,
+			   int dy, SDL_Point *dirs)
+{
+	int n = 0;
+
+	if (!dx && !dy) {
+		for (int j = -1; j <= 1; j++) {
+			for (int i = -1; i <= 1; i++) {
+				if ((!i && !j) || !path_free(s, x + i, y + j))
+					continue;
+				if (i && j && (!path_free(s, x + i, y) ||
+					       !path_free(s, x, y + j)))
+					continue;
+				dirs[n++] = (SDL_Point){ i, j };
+			}
+		}
+		return n;
+	}
+
+	if (dx && dy) {
+		int free_x = path_free(s, x + dx, y);
+		int free_y = path_free(s, x, y + dy);
+
+		if (free_y)
+			dirs[n++] = (SDL_Point){ 0, dy };
+		if (free_x)
+			dirs[n++] = (SDL_Point){ dx, 0 };
+		if (free_x && free_y)
+			dirs[n++] = (SDL_Point){ dx, dy };
+		return n;
+	}
+
+	if (dx) {
+		int up = path_free(s, x, y - 1);
+		int down = path_free(s, x, y + 1);
+
+		if (path_free(s, x + dx, y)) {
+			dirs[n++] = (SDL_Point){ dx, 0 };
+			if (up)
+				dirs[n++] = (SDL_Point){ dx, -1 };
+			if (down)
+				dirs[n++] = (SDL_Point){ dx, 1 };
+		}
+		if (up)
+			dirs[n++] = (SDL_Point){ 0, -1 };
+		if (down)
+			dirs[n++] = (SDL_Point){ 0, 1 };
+		return n;
+	}
+
+	int left = path_free(s, x - 1, y);
+	int right = path_free(s, x + 1, y);
+
+	if (path_free(s, x, y + dy)) {
+		dirs[n++] = (SDL_Point){ 0, dy };
+		if (left)
+			dirs[n++] = (SDL_Point){ -1, dy };
+		if (right)
+			dirs[n++] = (SDL_Point){ 1, dy };
+	}
+	if (left)
+		dirs[n++] = (SDL_Point){ -1, 0 };
+	if (right)
+		dirs[n++] = (SDL_Point){ 1, 0 };
+	return n;
+}
+
+static int open_list_push(struct l_open_list *list, uint32_t f, int node)
+{
+	int i;
+
+	if (list->len == list->size) {
+		int size = list->size ? list->size * 2 : 256;
+		struct l_path_open *heap = realloc(list->heap,
+						   size * sizeof(*heap));
+
+		if (heap == NULL)
+			return -ENOMEM;
+		list->heap = heap;
+		list->size = size;
+	}
+
+	// sift up
+	for (i = list->len++; i && list->heap[(i - 1) / 2].f > f;
+	     i = (i - 1) / 2)
+		list->heap[i] = list->heap[(i - 1) / 2];
+	list->heap[i] = (struct l_path_open){ f, node };
+
+	return 0;
+}
+
+static struct l_path_open open_list_pop(struct l_open_list *list)
+{
+	struct l_path_open top = list->heap[0];
+	struct l_path_open last = list->heap[--list->len];
+	int i = 0;
+
+	// sift down
+	for (;;) {
+		int child = i * 2 + 1;
+
+		if (child >= list->len)
+			break;
+		if (child + 1 < list->len &&
+		    list->heap[child + 1].f < list->heap[child].f)
+			child++;
+		if (last.f <= list->heap[child].f)
+			break;
+		list->heap[i] = list->heap[child];
+		i = child;
+	}
+	list->heap[i] = last;
+
+	return top;
+}
+
+// store the jump points from the start to the goal in the request
+static int path_store(struct l_path_search *s, struct l_path_request *req,
+		      int goal)
+{
+	int n = 0;
+
+	for (int node = goal; node >= 0; node = s->parent[node])
+		n++;
+
+	if (n > req->points_size) {
+		SDL_Point *points = realloc(req->points, n * sizeof(*points));
+
+		if (points == NULL)
+			return -ENOMEM;
+		req->points = points;
+		req->points_size = n;
+	}
+
+	req->nb_points = n;
+	for (int node = goal; node >= 0; node = s->parent[node]) {
+		n--;
+		req->points[n].x = s->window.x + node % s->window.w;
+		req->points[n].y = s->window.y + node / s->window.w;
+	}
+
+	return 0;
+}
+
+// jump point search, an A* only opening the nodes where the way may turn.
+// Search memory is reused: a node is reset lazily when its stamp is not the
+// one of the current query.
+static void path_find(struct l_path_search *s, struct l_level *level,
+		      struct l_path_request *req)
+{
+	uint32_t open_stamp, closed_stamp;
+	int start, goal;
+
+	req->nb_points = 0;
+	req->status = PATH_NOT_FOUND;
+	if (!path_window(level->map, req, &s->window)) {
+		req->status = PATH_TOO_FAR;
+		return;
+	}
+	s->walls = level->walls;
+	s->stride = level->map->chunks_x;
+	s->goal = req->goal;
+	if (!path_free(s, req->start.x, req->start.y) ||
+	    !path_free(s, req->goal.x, req->goal.y))
+		return;
+
+	// stamps wrapping around would make old nodes look current
+	if (s->stamp_base >= UINT32_MAX - 2) {
+		memset(s->stamp, 0, PATH_MAX_WINDOW * PATH_MAX_WINDOW *
+					    sizeof(*s->stamp));
+		s->stamp_base = 0;
+	}
+	s->stamp_base += 2;
+	open_stamp = s->stamp_base;
+	closed_stamp = s->stamp_base + 1;
+
+	start = path_node(s, req->start.x, req->start.y);
+	goal = path_node(s, req->goal.x, req->goal.y);
+	s->open.len = 0;
+	s->stamp[start] = open_stamp;
+	s->cost[start] = 0;
+	s->parent[start] = -1;
+	if (open_list_push(&s->open,
+			   path_distance(req->start.x, req->start.y,
+					 req->goal.x, req->goal.y),
+			   start) < 0)
+		return;
+
+	while (s->open.len) {
+		struct l_path_open open = open_list_pop(&s->open);
+		int node = open.node;
+		int x = s->window.x + node % s->window.w;
+		int y = s->window.y + node / s->window.w;
+		int dx = 0, dy = 0, nb_dirs;
+		SDL_Point dirs[8];
+
+		// nodes are pushed again instead of being updated in the heap
+		if (s->stamp[node] == closed_stamp)
+			continue;
+		s->stamp[node] = closed_stamp;
+
+		if (node == goal) {
+			if (path_store(s, req, goal) == 0)
+				req->status = PATH_FOUND;
+			return;
+		}
+
+		if (s->parent[node] >= 0) {
+			int parent = s->parent[node];
+
+			dx = x - (s->window.x + parent % s->window.w);
+			dy = y - (s->window.y + parent / s->window.w);
+			dx = (dx > 0) - (dx < 0);
+			dy = (dy > 0) - (dy < 0);
+		}
+
+		nb_dirs = path_directions(s, x, y, dx, dy, dirs);
+		for (int i = 0; i < nb_dirs; i++) {
+			SDL_Point jump;
+			uint32_t cost;
+			int next;
+
+			if (!path_jump(s, x, y, dirs[i].x, dirs[i].y, &jump))
+				continue;
+
+			next = path_node(s, jump.x, jump.y);
+			cost = s->cost[node] + path_distance(x, y, jump.x, jump.y);
+			if (s->stamp[next] == closed_stamp ||
+			    (s->stamp[next] == open_stamp && s->cost[next] <= cost))
+				continue;
+
+			s->stamp[next] = open_stamp;
+			s->cost[next] = cost;
+			s->parent[next] = node;
+			if (open_list_push(&s->open,
+					   cost + path_distance(jump.x, jump.y,
+								req->goal.x,
+								req->goal.y),
+					   next) < 0)
+				return;
+		}
+	}
+}
+
+static void path_job(void *data, int job, int worker)
+{
+	struct l_path_service *service = data;
+
+	path_find(&service->searches[worker], service->level,
+		  &service->requests[job]);
+}
+
+// route a batch of requests on the worker threads and the calling one,
+// returning once every request has its status
+static void path_service_run(struct l_path_service *service,
+			     struct l_path_request *requests, int nb_requests)
+{
+	struct l_level *level = service->level;
+	struct l_map *map = level->map;
+
+	// walls of the searched windows must be known, only the main thread
+	// can load chunks
+	for (int i = 0; i < nb_requests; i++) {
+		SDL_Rect window;
+
+		if (!path_window(map, &requests[i], &window))
+			continue;
+		window.x *= map->tile_w;
+		window.y *= map->tile_h;
+		window.w *= map->tile_w;
+		window.h *= map->tile_h;
+		level_require_rect(level, map->collision_layer, &window);
+	}
+
+	service->requests = requests;
+	workers_run(service->workers, path_job, service, nb_requests);
+	service->requests = NULL;
+}
+
+static void path_service_free(struct l_path_service *service)
+{
+	for (int i = 0; i <= MAX_WORKERS; i++) {
+		struct l_path_search *s = &service->searches[i];
+
+		free(s->stamp);
+		free(s->cost);
+		free(s->parent);
+		free(s->open.heap);
+	}
+	memset(service, 0, sizeof(*service));
+}
+
+// search memory for every worker
+static int path_service_init(struct l_path_service *service,
+			     struct l_level *level, struct l_workers *workers)
+{
+	int nb_nodes = PATH_MAX_WINDOW * PATH_MAX_WINDOW;
+
+	memset(service, 0, sizeof(*service));
+	service->level = level;
+	service->workers = workers;
+
+	for (int i = 0; i <= workers->nb_workers; i++) {
+		struct l_path_search *s = &service->searches[i];
+
+		s->stamp = calloc(nb_nodes, sizeof(*s->stamp));
+		s->cost = malloc(nb_nodes * sizeof(*s->cost));
+		s->parent = malloc(nb_nodes * sizeof(*s->parent));
+		if (!s->stamp || !s->cost || !s->parent) {
+			path_service_free(service);
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////
+// flow field functions
+///////////////////////////////////////////////////////
+
+static inline int flow_free(struct l_flow_field *field, int x, int y)
+{
+	if (x < field->x || y < field->y || x >= field->x + field->width ||
+	    y >= field->y + field->height)
+		return 0;
+
+	return !(field->level->walls[(size_t)y * field->level->map->chunks_x +
+				     (x >> MAP_CHUNK_SHIFT)] >>
+		 (x & MAP_CHUNK_MASK) & 1);
+}
+
+// bounds of the tiles of a chunk, within the field
+static inline void flow_chunk_bounds(struct l_flow_field *field, int chunk,
+				     int *x0, int *y0, int *x1, int *y1)
+{
+	*x0 = field->x + chunk % field->chunks_w * MAP_CHUNK_TILES;
+	*y0 = field->y + chunk / field->chunks_w * MAP_CHUNK_TILES;
+	*x1 = SDL_min(*x0 + MAP_CHUNK_TILES, field->x + field->width) - 1;
+	*y1 = SDL_min(*y0 + MAP_CHUNK_TILES, field->y + field->height) - 1;
+}
+
+static inline uint32_t *flow_cost(struct l_flow_field *field, int x, int y)
+{
+	return &field->cost[(size_t)(y - field->y) * field->width + x -
+			    field->x];
+}
+
+// neighbour reachable from x, y in direction d, diagonal moves not cutting
+// wall corners
+static inline int flow_can_move(struct l_flow_field *field, int x, int y,
+				int d)
+{
+	int dx = g_flow_dirs[d].x, dy = g_flow_dirs[d].y;
+
+	if (!flow_free(field, x, y) || !flow_free(field, x + dx, y + dy))
+		return 0;
+
+	return !(dx && dy) ||
+	       (flow_free(field, x + dx, y) && flow_free(field, x, y + dy));
+}
+
+// moves allowed from the tiles of a chunk, read from the walls once instead
+// of at every relaxing
+static void flow_chunk_moves(struct l_flow_field *field, int chunk)
+{
+	int x0, y0, x1, y1;
+
+	flow_chunk_bounds(field, chunk, &x0, &y0, &x1, &y1);
+	for (int y = y0; y <= y1; y++) {
+		for (int x = x0; x <= x1; x++) {
+			uint8_t moves = 0;
+
+			for (int d = 0; d < 8; d++)
+				moves |= flow_can_move(field, x, y, d) << d;
+			field->moves[(size_t)(y - field->y) * field->width + x -
+				     field->x] = moves;
+		}
+	}
+}
+
+static inline uint32_t flow_step(int d)
+{
+	return d & 1 ? PATH_COST_DIAGONAL : PATH_COST_STRAIGHT;
+}
+
+// lower the costs of a chunk from the ones around it, with a dijkstra search
+// restricted to the chunk. Only the chunk is written, its neighbours being
+// of another color they are not relaxed at the same time.
+static void flow_chunk_relax(struct l_flow_field *field, int chunk,
+			     struct l_open_list *open)
+{
+	int x0, y0, x1, y1;
+
+	int full = field->active[chunk] == FLOW_RELAX_FULL;
+
+	flow_chunk_bounds(field, chunk, &x0, &y0, &x1, &y1);
+	field->active[chunk] = 0;
+	field->border_changed[chunk] = 0;
+	open->len = 0;
+
+	// border tiles lowered by the tiles around start the search. The
+	// other tiles are already relaxed from each other, unless some of
+	// them were reset.
+	for (int y = y0; y <= y1; y++) {
+		for (int x = x0; x <= x1; x++) {
+			int node = (y - field->y) * field->width + x - field->x;
+			uint8_t moves = field->moves[node];
+			uint32_t *cost = &field->cost[node];
+			int lowered = 0;
+
+			if (x == x0 || x == x1 || y == y0 || y == y1) {
+				for (int d = 0; d < 8; d++) {
+					int nx = x + g_flow_dirs[d].x;
+					int ny = y + g_flow_dirs[d].y;
+					uint32_t c;
+
+					if (!(moves & 1 << d) ||
+					    (nx >= x0 && nx <= x1 && ny >= y0 &&
+					     ny <= y1))
+						continue;
+					c = *flow_cost(field, nx, ny);
+					if (c == FLOW_UNREACHED ||
+					    c + flow_step(d) >= *cost)
+						continue;
+					*cost = c + flow_step(d);
+					field->border_changed[chunk] = 1;
+					lowered = 1;
+				}
+			}
+
+			if ((lowered || (full && *cost != FLOW_UNREACHED)) &&
+			    moves && open_list_push(open, *cost, node) < 0)
+				return;
+		}
+	}
+
+	while (open->len) {
+		struct l_path_open node = open_list_pop(open);
+		uint8_t moves = field->moves[node.node];
+		int x = field->x + node.node % field->width;
+		int y = field->y + node.node / field->width;
+
+		if (node.f != field->cost[node.node])
+			continue;
+
+		for (int d = 0; d < 8; d++) {
+			int nx = x + g_flow_dirs[d].x, ny = y + g_flow_dirs[d].y;
+			uint32_t c = node.f + flow_step(d);
+			uint32_t *cost;
+
+			if (!(moves & 1 << d) || nx < x0 || nx > x1 || ny < y0 ||
+			    ny > y1)
+				continue;
+			cost = flow_cost(field, nx, ny);
+			if (c >= *cost)
+				continue;
+
+			*cost = c;
+			if (nx == x0 || nx == x1 || ny == y0 || ny == y1)
+				field->border_changed[chunk] = 1;
+			if (open_list_push(open, c,
+					   (ny - field->y) * field->width + nx -
+						   field->x) < 0)
+				return;
+		}
+	}
+}
+
+// point every tile of a chunk to its cheapest neighbour
+static void flow_chunk_dirs(struct l_flow_field *field, int chunk)
+{
+	int x0, y0, x1, y1;
+
+	flow_chunk_bounds(field, chunk, &x0, &y0, &x1, &y1);
+	for (int y = y0; y <= y1; y++) {
+		for (int x = x0; x <= x1; x++) {
+			size_t node = (size_t)(y - field->y) * field->width + x -
+				      field->x;
+			uint32_t best = field->cost[node];
+			int dir = FLOW_DIR_NONE;
+
+			for (int d = 0; d < 8 && best; d++) {
+				uint32_t c;
+
+				if (!(field->moves[node] & 1 << d))
+					continue;
+				c = *flow_cost(field, x + g_flow_dirs[d].x,
+					       y + g_flow_dirs[d].y);
+				if (c == FLOW_UNREACHED)
+					continue;
+				c += flow_step(d);
+				if (c <= best) {
+					best = c;
+					dir = d;
+				}
+			}
+			field->dir[node] = dir;
+		}
+	}
+}
+
+static void flow_relax_job(void *data, int job, int worker)
+{
+	struct l_flow_field *field = data;
+
+	flow_chunk_relax(field, field->jobs[job], &field->open[worker]);
+}
+
+static void flow_moves_job(void *data, int job, int worker)
+{
+	struct l_flow_field *field = data;
+
+	flow_chunk_moves(field, field->jobs[job]);
+}
+
+static void flow_dirs_job(void *data, int job, int worker)
+{
+	struct l_flow_field *field = data;
+
+	flow_chunk_dirs(field, field->jobs[job]);
+}
+
+// flag a chunk and the ones around it, keeping higher flags
+static void flow_mark_around(struct l_flow_field *field, uint8_t *flags,
+			     int chunk)
+{
+	int cx = chunk % field->chunks_w, cy = chunk / field->chunks_w;
+
+	for (int y = SDL_max(cy - 1, 0);
+	     y <= SDL_min(cy + 1, field->chunks_h - 1); y++)
+		for (int x = SDL_max(cx - 1, 0);
+		     x <= SDL_min(cx + 1, field->chunks_w - 1); x++)
+			flags[y * field->chunks_w + x] =
+				SDL_max(flags[y * field->chunks_w + x],
+					FLOW_RELAX_BORDER);
+}
+
+// walls of a chunk changed: the costs of the tiles whose way to the goal
+// may cross it are reset, they are all at least as far as the nearest tile
+// of the chunk. Closer tiles keep their costs.
+static void flow_field_walls_changed(struct l_flow_field *field, int chunk)
+{
+	uint32_t min_cost = FLOW_UNREACHED;
+	int x0, y0, x1, y1;
+
+	flow_chunk_bounds(field, chunk, &x0, &y0, &x1, &y1);
+	for (int y = y0; y <= y1; y++)
+		for (int x = x0; x <= x1; x++)
+			min_cost = SDL_min(min_cost, *flow_cost(field, x, y));
+
+	for (int c = 0; c < field->chunks_w * field->chunks_h; c++) {
+		flow_chunk_bounds(field, c, &x0, &y0, &x1, &y1);
+		for (int y = y0; y <= y1; y++) {
+			for (int x = x0; x <= x1; x++) {
+				uint32_t *cost = flow_cost(field, x, y);
+
+				if (*cost == FLOW_UNREACHED ||
+				    (*cost < min_cost && c != chunk))
+					continue;
+				*cost = FLOW_UNREACHED;
+				field->active[c] = FLOW_RELAX_FULL;
+			}
+		}
+	}
+
+	if (flow_free(field, field->goal.x, field->goal.y))
+		*flow_cost(field, field->goal.x, field->goal.y) = 0;
+	// walls removed may open shorter ways to the tiles around
+	field->active[chunk] = FLOW_RELAX_FULL;
+}
+
+// bring the field up to date with the level walls, relaxing the chunks that
+// may have changed by batches of chunks of the same color in parallel
+static void flow_field_update(struct l_flow_field *field)
+{
+	struct l_map *map = field->level->map;
+	int nb_chunks = field->chunks_w * field->chunks_h;
+	int active = 0;
+
+	// moves of the tiles around changed walls
+	for (int c = 0; c < nb_chunks; c++) {
+		int index = (field->cy + c / field->chunks_w) * map->chunks_x +
+			    field->cx + c % field->chunks_w;
+
+		if (field->walls_version[c] !=
+		    field->level->walls_version[index]) {
+			field->walls_version[c] =
+				field->level->walls_version[index];
+			field->walls_changed[c] = 1;
+			flow_mark_around(field, field->moves_dirty, c);
+		}
+	}
+	field->nb_jobs = 0;
+	for (int c = 0; c < nb_chunks; c++) {
+		if (!field->moves_dirty[c])
+			continue;
+		field->moves_dirty[c] = 0;
+		field->jobs[field->nb_jobs++] = c;
+	}
+	workers_run(field->workers, flow_moves_job, field, field->nb_jobs);
+
+	for (int c = 0; c < nb_chunks; c++) {
+		if (!field->walls_changed[c])
+			continue;
+		field->walls_changed[c] = 0;
+		flow_field_walls_changed(field, c);
+	}
+
+	do {
+		active = 0;
+
+		// chunks of the same color are not neighbours, even by a
+		// corner
+		for (int color = 0; color < 4; color++) {
+			field->nb_jobs = 0;
+			for (int c = 0; c < nb_chunks; c++) {
+				int cx = c % field->chunks_w;
+				int cy = c / field->chunks_w;
+
+				if (!field->active[c] ||
+				    (cx & 1) + (cy & 1) * 2 != color)
+					continue;
+				field->jobs[field->nb_jobs++] = c;
+			}
+
+			workers_run(field->workers, flow_relax_job, field,
+				    field->nb_jobs);
+
+			for (int i = 0; i < field->nb_jobs; i++) {
+				int c = field->jobs[i];
+
+				flow_mark_around(field, field->dir_dirty, c);
+				if (!field->border_changed[c])
+					continue;
+				flow_mark_around(field, field->active, c);
+				field->active[c] = 0;
+				active = 1;
+			}
+		}
+	} while (active);
+
+	field->nb_jobs = 0;
+	for (int c = 0; c < nb_chunks; c++) {
+		if (!field->dir_dirty[c])
+			continue;
+		field->dir_dirty[c] = 0;
+		field->jobs[field->nb_jobs++] = c;
+	}
+	workers_run(field->workers, flow_dirs_job, field, field->nb_jobs);
+}
+
+// FLOW_DIR_* index of the way to the goal from a tile, FLOW_DIR_NONE out of
+// the field, on the goal or where it cannot be reached
+static inline int flow_field_direction(struct l_flow_field *field, int x,
+				       int y)
+{
+	if (x < field->x || y < field->y || x >= field->x + field->width ||
+	    y >= field->y + field->height)
+		return FLOW_DIR_NONE;
+
+	return field->dir[(size_t)(y - field->y) * field->width + x - field->x];
+}
+
+static void flow_field_free(struct l_flow_field *field)
+{
+	free(field->cost);
+	free(field->moves);
+	free(field->dir);
+	free(field->walls_version);
+	free(field->walls_changed);
+	free(field->moves_dirty);
+	free(field->active);
+	free(field->border_changed);
+	free(field->dir_dirty);
+	free(field->jobs);
+	for (int i = 0; i <= MAX_WORKERS; i++)
+		free(field->open[i].heap);
+	memset(field, 0, sizeof(*field));
+}
+
+// field over the chunks around the goal one, its walls are made resident
+// and its costs computed from the goal
+static int flow_field_init(struct l_flow_field *field, struct l_level *level,
+			   struct l_workers *workers, SDL_Point goal)
+{
+	struct l_map *map = level->map;
+	int goal_cx = goal.x >> MAP_CHUNK_SHIFT, goal_cy = goal.y >> MAP_CHUNK_SHIFT;
+	size_t nb_tiles;
+	int nb_chunks;
+	SDL_Rect area;
+
+	memset(field, 0, sizeof(*field));
+	field->level = level;
+	field->workers = workers;
+	field->goal = goal;
+	field->cx = SDL_max(goal_cx - FLOW_RADIUS, 0);
+	field->cy = SDL_max(goal_cy - FLOW_RADIUS, 0);
+	field->chunks_w = SDL_min(goal_cx + FLOW_RADIUS, map->chunks_x - 1) -
+			  field->cx + 1;
+	field->chunks_h = SDL_min(goal_cy + FLOW_RADIUS, map->chunks_y - 1) -
+			  field->cy + 1;
+	field->x = field->cx * MAP_CHUNK_TILES;
+	field->y = field->cy * MAP_CHUNK_TILES;
+	// the last chunks may go past the map border
+	field->width = SDL_min(field->chunks_w * MAP_CHUNK_TILES,
+			       map->width - field->x);
+	field->height = SDL_min(field->chunks_h * MAP_CHUNK_TILES,
+				map->height - field->y);
+
+	nb_tiles = (size_t)field->width * field->height;
+	nb_chunks = field->chunks_w * field->chunks_h;
+	field->cost = malloc(nb_tiles * sizeof(*field->cost));
+	field->moves = malloc(nb_tiles * sizeof(*field->moves));
+	field->dir = malloc(nb_tiles * sizeof(*field->dir));
+	field->walls_version = calloc(nb_chunks, sizeof(*field->walls_version));
+	field->walls_changed = calloc(nb_chunks,
+				      sizeof(*field->walls_changed));
+	field->moves_dirty = calloc(nb_chunks, sizeof(*field->moves_dirty));
+	field->active = calloc(nb_chunks, sizeof(*field->active));
+	field->border_changed = calloc(nb_chunks,
+				       sizeof(*field->border_changed));
+	field->dir_dirty = calloc(nb_chunks, sizeof(*field->dir_dirty));
+	field->jobs = malloc(nb_chunks * sizeof(*field->jobs));
+	if (!field->cost || !field->moves || !field->dir ||
+	    !field->walls_version || !field->walls_changed ||
+	    !field->moves_dirty ||
+	    !field->active || !field->border_changed || !field->dir_dirty ||
+	    !field->jobs) {
+		flow_field_free(field);
+		return -ENOMEM;
+	}
+
+	// walls of the whole field must be known
+	area.x = field->x * map->tile_w;
+	area.y = field->y * map->tile_h;
+	area.w = field->width * map->tile_w;
+	area.h = field->height * map->tile_h;
+	if (level_require_rect(level, map->collision_layer, &area) < 0) {
+		flow_field_free(field);
+		return -ENOMEM;
+	}
+
+	for (size_t i = 0; i < nb_tiles; i++)
+		field->cost[i] = FLOW_UNREACHED;
+	memset(field->moves_dirty, 1, nb_chunks);
+	memset(field->dir_dirty, 1, nb_chunks);
+	for (int c = 0; c < nb_chunks; c++)
+		field->walls_version[c] =
+			level->walls_version[(field->cy + c / field->chunks_w) *
+						     map->chunks_x +
+					     field->cx + c % field->chunks_w];
+
+	// costs spread from the goal chunk
+	if (flow_free(field, goal.x, goal.y)) {
+		*flow_cost(field, goal.x, goal.y) = 0;
+		field->active[(goal_cy - field->cy) * field->chunks_w + goal_cx -
+			      field->cx] = FLOW_RELAX_FULL;
+	}
+	flow_field_update(field);
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////
+// raycasting functions
+///////////////////////////////////////////////////////
+
+static void ray_batch_free(struct l_ray_batch *batch)
+{
+	free(batch->x0);
+	free(batch->y0);
+	free(batch->x1);
+	free(batch->y1);
+	free(batch->hit);
+	memset(batch, 0, sizeof(*batch));
+}
+
+// empty the batch, making room for nb_rays rays
+static int ray_batch_reset(struct l_ray_batch *batch, int nb_rays)
+{
+	float **arrays[] = { &batch->x0, &batch->y0, &batch->x1, &batch->y1,
+			     &batch->hit };
+
+	batch->nb_rays = 0;
+	if (nb_rays <= batch->size)
+		return 0;
+
+	for (size_t i = 0; i < SDL_arraysize(arrays); i++) {
+		float *array = realloc(*arrays[i], nb_rays * sizeof(*array));
+
+		if (array == NULL)
+			return -ENOMEM;
+		*arrays[i] = array;
+	}
+	batch->size = nb_rays;
+
+	return 0;
+}
+
+// segment from x0, y0 to x1, y1, in level pixels
+static inline void ray_batch_add(struct l_ray_batch *batch, float x0,
+				 float y0, float x1, float y1)
+{
+	int i = batch->nb_rays++;
+
+	batch->x0[i] = x0;
+	batch->y0[i] = y0;
+	batch->x1[i] = x1;
+	batch->y1[i] = y1;
+}
+
+// walk the tiles crossed by RAY_LANES rays at once, one tile per ray and
+// per step. Lanes are updated with selects instead of branches, only the
+// wall bitmap reads are not contiguous.
+static void ray_cast_lanes(struct l_level *level, struct l_ray_batch *batch,
+			   int first, int count)
+{
+	struct l_map *map = level->map;
+	uint64_t *walls = level->walls;
+	int stride = map->chunks_x;
+	int tx[RAY_LANES], ty[RAY_LANES], sx[RAY_LANES], sy[RAY_LANES];
+	float t[RAY_LANES], t_max_x[RAY_LANES], t_max_y[RAY_LANES];
+	float t_delta_x[RAY_LANES], t_delta_y[RAY_LANES];
+	int active[RAY_LANES];
+	int nb_active = 0;
+
+	for (int l = 0; l < RAY_LANES; l++) {
+		int i = first + SDL_min(l, count - 1);
+		// ray in tile units, t going from 0 to 1 along the segment
+		float fx = batch->x0[i] / map->tile_w;
+		float fy = batch->y0[i] / map->tile_h;
+		float dx = (batch->x1[i] - batch->x0[i]) / map->tile_w;
+		float dy = (batch->y1[i] - batch->y0[i]) / map->tile_h;
+
+		tx[l] = (int)floorf(fx);
+		ty[l] = (int)floorf(fy);
+		sx[l] = dx < 0 ? -1 : 1;
+		sy[l] = dy < 0 ? -1 : 1;
+		t_delta_x[l] = dx ? fabsf(1 / dx) : INFINITY;
+		t_delta_y[l] = dy ? fabsf(1 / dy) : INFINITY;
+		t_max_x[l] = dx ? (dx > 0 ? tx[l] + 1 - fx : fx - tx[l]) *
+					  t_delta_x[l] :
+				  INFINITY;
+		t_max_y[l] = dy ? (dy > 0 ? ty[l] + 1 - fy : fy - ty[l]) *
+					  t_delta_y[l] :
+				  INFINITY;
+		t[l] = 0;
+		// padding lanes of the last block are not cast
+		active[l] = l < count;
+		nb_active += active[l];
+	}
+
+	while (nb_active) {
+		nb_active = 0;
+		for (int l = 0; l < RAY_LANES; l++) {
+			int inside = tx[l] >= 0 && ty[l] >= 0 &&
+				     tx[l] < map->width && ty[l] < map->height;
+			int x = SDL_clamp(tx[l], 0, map->width - 1);
+			int y = SDL_clamp(ty[l], 0, map->height - 1);
+			int wall = walls[(size_t)y * stride + (x >> MAP_CHUNK_SHIFT)] >>
+					   (x & MAP_CHUNK_MASK) &
+				   1;
+			// the map border stops rays like a wall
+			int hit = active[l] & (wall | !inside);
+			int step_x = t_max_x[l] < t_max_y[l];
+			float next = step_x ? t_max_x[l] : t_max_y[l];
+
+			if (active[l])
+				batch->hit[first + l] = hit ? t[l] : 1;
+			active[l] &= !hit & (next <= 1);
+			t[l] = next;
+			tx[l] += step_x ? sx[l] : 0;
+			ty[l] += step_x ? 0 : sy[l];
+			t_max_x[l] += step_x ? t_delta_x[l] : 0;
+			t_max_y[l] += step_x ? 0 : t_delta_y[l];
+			nb_active += active[l];
+		}
+	}
+}
+
+static void ray_job(void *data, int job, int worker)
+{
+	struct l_ray_job *rays = data;
+	int end = SDL_min((job + 1) * RAY_JOB_SIZE, rays->batch->nb_rays);
+
+	for (int i = job * RAY_JOB_SIZE; i < end; i += RAY_LANES)
+		ray_cast_lanes(rays->level, rays->batch, i,
+			       SDL_min(RAY_LANES, end - i));
+}
+
+// cast every ray of a batch on the workers. The hit of a ray is the
+// fraction of its segment travelled before entering a wall or leaving the
+// map, 1 if the way is clear: the end can be seen from the start.
+static void ray_batch_cast(struct l_level *level, struct l_workers *workers,
+			   struct l_ray_batch *batch)
+{
+	struct l_ray_job rays = { level, batch };
+
+	// walls along the rays must be known, only the main thread can load
+	// chunks
+	for (int i = 0; i < batch->nb_rays; i++) {
+		SDL_Rect box = {
+			.x = SDL_min(batch->x0[i], batch->x1[i]),
+			.y = SDL_min(batch->y0[i], batch->y1[i]),
+			.w = fabsf(batch->x1[i] - batch->x0[i]) + 1,
+			.h = fabsf(batch->y1[i] - batch->y0[i]) + 1,
+		};
+
+		level_require_rect(level, level->map->collision_layer, &box);
+	}
+
+	workers_run(workers, ray_job, &rays,
+		    (batch->nb_rays + RAY_JOB_SIZE - 1) / RAY_JOB_SIZE);
+}
+
+///////////////////////////////////////////////////////
+// fog of war functions
+///////////////////////////////////////////////////////
+
+static inline int fog_bit(struct l_fog *fog, uint64_t *grid, int x, int y)
+{
+	return grid[(size_t)y * fog->stride + (x >> MAP_CHUNK_SHIFT)] >>
+		       (x & MAP_CHUNK_MASK) &
+	       1;
+}
+
+static inline void fog_set_bit(struct l_fog *fog, uint64_t *grid, int x, int y)
+{
+	grid[(size_t)y * fog->stride + (x >> MAP_CHUNK_SHIFT)] |=
+		1ull << (x & MAP_CHUNK_MASK);
+}
+
+// tiles in sight of an observer standing on a tile, before walls
+static void fog_sight_range(struct l_map *map, SDL_Point tile,
+			    struct l_tile_range *range)
+{
+	range->col_min = SDL_max(tile.x - FOG_RADIUS, 0);
+	range->row_min = SDL_max(tile.y - FOG_RADIUS, 0);
+	range->col_max = SDL_min(tile.x + FOG_RADIUS, map->width - 1);
+	range->row_max = SDL_min(tile.y + FOG_RADIUS, map->height - 1);
+}
+
+static inline int fog_range_clip(struct l_tile_range *a,
+				 struct l_tile_range *b,
+				 struct l_tile_range *out)
+{
+	out->col_min = SDL_max(a->col_min, b->col_min);
+	out->row_min = SDL_max(a->row_min, b->row_min);
+	out->col_max = SDL_min(a->col_max, b->col_max);
+	out->row_max = SDL_min(a->row_max, b->row_max);
+
+	return !chunk_range_empty(out);
+}
+
+static int fog_add_dirty(struct l_fog *fog, SDL_Point tile)
+{
+	struct l_tile_range *r;
+
+	if (fog->nb_dirty == fog->dirty_size) {
+		int size = fog->dirty_size ? fog->dirty_size * 2 : 64;
+		struct l_tile_range *dirty;
+
+		dirty = realloc(fog->dirty, size * sizeof(*dirty));
+		if (dirty == NULL)
+			return -ENOMEM;
+		fog->dirty = dirty;
+		fog->dirty_size = size;
+	}
+	r = &fog->dirty[fog->nb_dirty++];
+	fog_sight_range(fog->level->map, tile, r);
+
+	for (int y = r->row_min; y <= r->row_max; y++)
+		for (int x = r->col_min; x <= r->col_max; x++)
+			fog_set_bit(fog, fog->dirty_tiles, x, y);
+
+	if (fog->nb_dirty == 1) {
+		fog->dirty_range = *r;
+	} else {
+		fog->dirty_range.col_min = SDL_min(fog->dirty_range.col_min,
+						   r->col_min);
+		fog->dirty_range.row_min = SDL_min(fog->dirty_range.row_min,
+						   r->row_min);
+		fog->dirty_range.col_max = SDL_max(fog->dirty_range.col_max,
+						   r->col_max);
+		fog->dirty_range.row_max = SDL_max(fog->dirty_range.row_max,
+						   r->row_max);
+	}
+
+	return 0;
+}
+
+// fraction of a segment going from p0 to p1 where it enters the span of a
+// tile along one axis
+static inline float fog_entry(float p0, float p1, int tile, int size)
+{
+	if (p1 > p0)
+		return (tile * size - p0) / (p1 - p0);
+	if (p1 < p0)
+		return ((tile + 1) * size - p0) / (p1 - p0);
+	return -INFINITY;
+}
+
+static int fog_compare_eyes(const void *a, const void *b)
+{
+	const SDL_Point *pa = a, *pb = b;
+
+	if (pa->y != pb->y)
+		return pa->y - pb->y;
+	return pa->x - pb->x;
+}
+
+// rays from the observers to the dirty tiles in their sight, once per tile
+// even where dirty areas overlap. Returns the number of rays, only counted
+// if add is 0.
+static int fog_add_rays(struct l_fog *fog, int add)
+{
+	struct l_map *map = fog->level->map;
+	int nb_rays = 0;
+
+	for (int i = 0; i < fog->nb_eyes; i++) {
+		SDL_Point o = fog->eyes[i];
+		struct l_tile_range sight, r;
+
+		fog_sight_range(map, o, &sight);
+		if (!fog_range_clip(&sight, &fog->dirty_range, &r))
+			continue;
+		for (int y = r.row_min; y <= r.row_max; y++) {
+			for (int x = r.col_min; x <= r.col_max; x++) {
+				int dx = x - o.x, dy = y - o.y;
+
+				// round sight
+				if (dx * dx + dy * dy > FOG_RADIUS * FOG_RADIUS ||
+				    !fog_bit(fog, fog->dirty_tiles, x, y))
+					continue;
+				nb_rays++;
+				if (!add)
+					continue;
+				// from tile center to tile center
+				ray_batch_add(&fog->rays,
+					      o.x * map->tile_w + map->tile_w / 2,
+					      o.y * map->tile_h + map->tile_h / 2,
+					      x * map->tile_w + map->tile_w / 2,
+					      y * map->tile_h + map->tile_h / 2);
+			}
+		}
+	}
+
+	return nb_rays;
+}
+
+// move the observers to the given positions, in level pixels. Sight is only
+// cast again around the observers whose tile changed: visibility is cleared
+// where they were and where they are, then every observer seeing these
+// areas casts rays into them.
+static int fog_update(struct l_fog *fog, SDL_Point *positions, int nb)
+{
+	struct l_map *map = fog->level->map;
+	int nb_rays;
+
+	if (nb > fog->observers_size) {
+		SDL_Point *observers, *eyes;
+
+		observers = realloc(fog->observers, nb * sizeof(*observers));
+		if (observers == NULL)
+			return -ENOMEM;
+		fog->observers = observers;
+		eyes = realloc(fog->eyes, nb * sizeof(*eyes));
+		if (eyes == NULL)
+			return -ENOMEM;
+		fog->eyes = eyes;
+		fog->observers_size = nb;
+	}
+
+	fog->nb_dirty = 0;
+	for (int i = 0; i < SDL_max(nb, fog->nb_observers); i++) {
+		SDL_Point tile = { -1, -1 };
+
+		if (i < nb) {
+			tile.x = SDL_clamp(positions[i].x / map->tile_w, 0,
+					   map->width - 1);
+			tile.y = SDL_clamp(positions[i].y / map->tile_h, 0,
+					   map->height - 1);
+		}
+		if (i < fog->nb_observers) {
+			if (tile.x == fog->observers[i].x &&
+			    tile.y == fog->observers[i].y)
+				continue;
+			if (fog_add_dirty(fog, fog->observers[i]) < 0)
+				return -ENOMEM;
+		}
+		if (i < nb) {
+			if (fog_add_dirty(fog, tile) < 0)
+				return -ENOMEM;
+			fog->observers[i] = tile;
+		}
+	}
+	fog->nb_observers = nb;
+	if (fog->nb_dirty == 0)
+		return 0;
+
+	memcpy(fog->eyes, fog->observers, nb * sizeof(*fog->eyes));
+	qsort(fog->eyes, nb, sizeof(*fog->eyes), fog_compare_eyes);
+	fog->nb_eyes = 0;
+	for (int i = 0; i < nb; i++)
+		if (fog->nb_eyes == 0 ||
+		    fog_compare_eyes(&fog->eyes[i],
+				     &fog->eyes[fog->nb_eyes - 1]))
+			fog->eyes[fog->nb_eyes++] = fog->eyes[i];
+
+	for (int y = fog->dirty_range.row_min; y <= fog->dirty_range.row_max; y++)
+		for (int w = fog->dirty_range.col_min >> MAP_CHUNK_SHIFT;
+		     w <= fog->dirty_range.col_max >> MAP_CHUNK_SHIFT; w++)
+			fog->visible[(size_t)y * fog->stride + w] &=
+				~fog->dirty_tiles[(size_t)y * fog->stride + w];
+
+	nb_rays = fog_add_rays(fog, 0);
+	if (ray_batch_reset(&fog->rays, nb_rays) < 0)
+		return -ENOMEM;
+	fog_add_rays(fog, 1);
+	ray_batch_cast(fog->level, fog->workers, &fog->rays);
+
+	// a tile is seen if the first wall on the way is the tile itself
+	for (int i = 0; i < fog->rays.nb_rays; i++) {
+		float x0 = fog->rays.x0[i], y0 = fog->rays.y0[i];
+		float x1 = fog->rays.x1[i], y1 = fog->rays.y1[i];
+		int x = x1 / map->tile_w, y = y1 / map->tile_h;
+		float entry = SDL_max(fog_entry(x0, x1, x, map->tile_w),
+				      fog_entry(y0, y1, y, map->tile_h));
+
+		if (fog->rays.hit[i] < entry - 1e-3f)
+			continue;
+		fog_set_bit(fog, fog->visible, x, y);
+		fog_set_bit(fog, fog->revealed, x, y);
+	}
+
+	for (int y = fog->dirty_range.row_min; y <= fog->dirty_range.row_max; y++)
+		for (int w = fog->dirty_range.col_min >> MAP_CHUNK_SHIFT;
+		     w <= fog->dirty_range.col_max >> MAP_CHUNK_SHIFT; w++)
+			fog->dirty_tiles[(size_t)y * fog->stride + w] = 0;
+	fog->texture_dirty = 1;
+
+	return 0;
+}
+
+// walls changed, every observer casts its sight again at the next update
+static void fog_invalidate(struct l_fog *fog)
+{
+	struct l_map *map = fog->level->map;
+
+	memset(fog->visible, 0,
+	       (size_t)fog->stride * map->height * sizeof(*fog->visible));
+	fog->nb_observers = 0;
+	fog->texture_dirty = 1;
+}
+
+// grow the texture to hold a tile range
+static int fog_texture_fit(struct l_fog *fog, int w, int h)
+{
+	SDL_Texture *texture;
+
+	if (fog->texture && w <= fog->texture_w && h <= fog->texture_h)
+		return 0;
+
+	w = SDL_max(w, fog->texture_w);
+	h = SDL_max(h, fog->texture_h);
+	texture = SDL_CreateTexture(g_renderer, SDL_PIXELFORMAT_ARGB8888,
+				    SDL_TEXTUREACCESS_STREAMING, w, h);
+	if (texture == NULL) {
+		printf("Unable to create fog texture! SDL Error: %s\n",
+		       SDL_GetError());
+		return -ENOMEM;
+	}
+	SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+	if (fog->texture)
+		SDL_DestroyTexture(fog->texture);
+	fog->texture = texture;
+	fog->texture_w = w;
+	fog->texture_h = h;
+	fog->texture_dirty = 1;
+
+	return 0;
+}
+
+// darken the tiles not in sight, one texel per tile stretched over the
+// screen. The texture is only written when the fog or the tiles seen by the
+// camera changed.
+static void fog_render(struct l_fog *fog, SDL_Rect *camera)
+{
+	struct l_map *map = fog->level->map;
+	struct l_tile_range range;
+	SDL_Rect cam, src, dst;
+
+	layer_camera(map, map->collision_layer, camera, &cam);
+	if (!map_tile_range(map, &cam, &range))
+		return;
+
+	src.x = 0;
+	src.y = 0;
+	src.w = range.col_max - range.col_min + 1;
+	src.h = range.row_max - range.row_min + 1;
+	if (fog_texture_fit(fog, src.w, src.h) < 0)
+		return;
+
+	if (fog->texture_dirty ||
+	    memcmp(&range, &fog->texture_range, sizeof(range))) {
+		Uint32 *pixels;
+		int pitch;
+
+		if (SDL_LockTexture(fog->texture, &src, (void **)&pixels,
+				    &pitch) < 0)
+			return;
+		for (int y = 0; y < src.h; y++) {
+			Uint32 *row = (Uint32 *)((Uint8 *)pixels + y * pitch);
+
+			for (int x = 0; x < src.w; x++) {
+				int col = range.col_min + x;
+				int line = range.row_min + y;
+				Uint32 alpha = FOG_HIDDEN;
+
+				if (fog_bit(fog, fog->visible, col, line))
+					alpha = 0;
+				else if (fog_bit(fog, fog->revealed, col, line))
+					alpha = FOG_REVEALED;
+				row[x] = alpha << 24;
+			}
+		}
+		SDL_UnlockTexture(fog->texture);
+		fog->texture_range = range;
+		fog->texture_dirty = 0;
+	}
+
+	dst.x = range.col_min * map->tile_w - cam.x;
+	dst.y = range.row_min * map->tile_h - cam.y;
+	dst.w = src.w * map->tile_w;
+	dst.h = src.h * map->tile_h;
+	SDL_RenderCopy(g_renderer, fog->texture, &src, &dst);
+}
+
+static void fog_free(struct l_fog *fog)
+{
+	free(fog->visible);
+	free(fog->revealed);
+	free(fog->observers);
+	free(fog->eyes);
+	free(fog->dirty);
+	free(fog->dirty_tiles);
+	ray_batch_free(&fog->rays);
+	if (fog->texture)
+		SDL_DestroyTexture(fog->texture);
+	memset(fog, 0, sizeof(*fog));
+}
+
+// nothing seen or revealed yet. Sight is cast on the workers.
+static int fog_init(struct l_fog *fog, struct l_level *level,
+		    struct l_workers *workers)
+{
+	struct l_map *map = level->map;
+	size_t words;
+
+	memset(fog, 0, sizeof(*fog));
+	fog->level = level;
+	fog->workers = workers;
+	fog->stride = map->chunks_x;
+	words = (size_t)fog->stride * map->height;
+	fog->visible = calloc(words, sizeof(*fog->visible));
+	fog->revealed = calloc(words, sizeof(*fog->revealed));
+	fog->dirty_tiles = calloc(words, sizeof(*fog->dirty_tiles));
+	if (!fog->visible || !fog->revealed || !fog->dirty_tiles) {
+		fog_free(fog);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////
+// minimap functions
+///////////////////////////////////////////////////////
+
+// average colors of the collision layer tiles under texels tx_min to tx_max
+// of row ty. Tiles are read a chunk at a time with level_read_rows(), never
+// from the map mapping, so any thread can compute texels.
+static void minimap_texels(struct l_minimap *minimap, int ty, int tx_min,
+			   int tx_max, Uint32 *colors)
+{
+	struct l_level *level = minimap->level;
+	struct l_map *map = level->map;
+	int step = minimap->step;
+	int x0 = tx_min * step, y0 = ty * step;
+	int x1 = SDL_min((tx_max + 1) * step, map->width) - 1;
+	int y1 = SDL_min(y0 + step, map->height) - 1;
+	uint8_t rows[MAP_CHUNK_SIZE];
+	Uint32 sums[MINIMAP_SIZE][4] = { 0 };
+
+	for (int cy = y0 >> MAP_CHUNK_SHIFT; cy <= y1 >> MAP_CHUNK_SHIFT; cy++) {
+		int ya = SDL_max(y0, cy << MAP_CHUNK_SHIFT) & MAP_CHUNK_MASK;
+		int yb = SDL_min(y1, (cy << MAP_CHUNK_SHIFT) + MAP_CHUNK_MASK) &
+			 MAP_CHUNK_MASK;
+
+		for (int cx = x0 >> MAP_CHUNK_SHIFT; cx <= x1 >> MAP_CHUNK_SHIFT;
+		     cx++) {
+			int id = (map->collision_layer * map->chunks_y + cy) *
+					 map->chunks_x +
+				 cx;
+			int xa = SDL_max(x0, cx << MAP_CHUNK_SHIFT);
+			int xb = SDL_min(x1, (cx << MAP_CHUNK_SHIFT) +
+						     MAP_CHUNK_MASK);
+
+			level_read_rows(level, id, ya, yb, rows);
+			for (int y = 0; y <= yb - ya; y++) {
+				uint8_t *types = &rows[y * MAP_CHUNK_TILES];
+
+				// tiles of a texel are contiguous up to its
+				// border
+				for (int x = xa; x <= xb;) {
+					int tx = x / step;
+					int end = SDL_min(xb, (tx + 1) * step - 1);
+					Uint32 *sum = sums[tx - tx_min];
+
+					for (; x <= end; x++) {
+						Uint32 c = g_minimap_colors
+							[types[x &
+							       MAP_CHUNK_MASK]];
+
+						sum[0] += c & 0xFF;
+						sum[1] += c >> 8 & 0xFF;
+						sum[2] += c >> 16 & 0xFF;
+						sum[3] += c >> 24;
+					}
+				}
+			}
+		}
+	}
+
+	for (int tx = tx_min; tx <= tx_max; tx++) {
+		Uint32 *sum = sums[tx - tx_min];
+		Uint32 n = (SDL_min((tx + 1) * step, map->width) - tx * step) *
+			   (y1 - y0 + 1);
+
+		colors[tx - tx_min] = 0;
+		for (int i = 0; i < 4; i++)
+			colors[tx - tx_min] |= sum[i] / n << (i * 8);
+	}
+}
+
+// write a texel, zoom x zoom pixels. Returns 0 if it did not change.
+static int minimap_set_texel(struct l_minimap *minimap, int tx, int ty,
+			     Uint32 color)
+{
+	int pitch = minimap->width * minimap->zoom;
+	Uint32 *p = &minimap->pixels[(size_t)ty * minimap->zoom * pitch +
+				     tx * minimap->zoom];
+
+	if (*p == color)
+		return 0;
+	for (int y = 0; y < minimap->zoom; y++)
+		for (int x = 0; x < minimap->zoom; x++)
+			p[y * pitch + x] = color;
+
+	return 1;
+}
+
+static void minimap_row_job(void *data, int job, int worker)
+{
+	struct l_minimap *minimap = data;
+	Uint32 colors[MINIMAP_SIZE];
+
+	minimap_texels(minimap, job, 0, minimap->width - 1, colors);
+	for (int tx = 0; tx < minimap->width; tx++)
+		minimap_set_texel(minimap, tx, job, colors[tx]);
+}
+
+// compute the texels of the chunks changed by a reload again, and upload
+// the ones whose color changed
+static void minimap_update(struct l_minimap *minimap)
+{
+	struct l_level *level = minimap->level;
+	struct l_map *map = level->map;
+	int pitch = minimap->width * minimap->zoom;
+
+	for (int ci = 0; ci < map->layer_chunks; ci++) {
+		int cx = ci % map->chunks_x, cy = ci / map->chunks_x;
+		struct l_tile_range r = { 0 }, changed;
+		Uint32 colors[MINIMAP_SIZE];
+		SDL_Rect rect;
+
+		if (minimap->versions[ci] == level->tiles_version[ci])
+			continue;
+		minimap->versions[ci] = level->tiles_version[ci];
+
+		r.col_min = (cx << MAP_CHUNK_SHIFT) / minimap->step;
+		r.row_min = (cy << MAP_CHUNK_SHIFT) / minimap->step;
+		r.col_max = SDL_min(((cx + 1) << MAP_CHUNK_SHIFT) - 1,
+				    map->width - 1) /
+			    minimap->step;
+		r.row_max = SDL_min(((cy + 1) << MAP_CHUNK_SHIFT) - 1,
+				    map->height - 1) /
+			    minimap->step;
+
+		// empty until a texel changes
+		changed.col_min = r.col_max + 1;
+		changed.row_min = r.row_max + 1;
+		changed.col_max = -1;
+		changed.row_max = -1;
+		for (int ty = r.row_min; ty <= r.row_max; ty++) {
+			minimap_texels(minimap, ty, r.col_min, r.col_max,
+				       colors);
+			for (int tx = r.col_min; tx <= r.col_max; tx++) {
+				if (!minimap_set_texel(minimap, tx, ty,
+						       colors[tx - r.col_min]))
+					continue;
+				changed.col_min = SDL_min(changed.col_min, tx);
+				changed.row_min = SDL_min(changed.row_min, ty);
+				changed.col_max = SDL_max(changed.col_max, tx);
+				changed.row_max = SDL_max(changed.row_max, ty);
+			}
+		}
+		if (chunk_range_empty(&changed))
+			continue;
+
+		rect.x = changed.col_min * minimap->zoom;
+		rect.y = changed.row_min * minimap->zoom;
+		rect.w = (changed.col_max - changed.col_min + 1) * minimap->zoom;
+		rect.h = (changed.row_max - changed.row_min + 1) * minimap->zoom;
+		SDL_UpdateTexture(minimap->texture, &rect,
+				  &minimap->pixels[(size_t)rect.y * pitch + rect.x],
+				  pitch * sizeof(*minimap->pixels));
+	}
+}
+
+// minimap in the top right corner of the screen, with the camera outline
+static void minimap_render(struct l_minimap *minimap, SDL_Rect *camera)
+{
+	struct l_map *map = minimap->level->map;
+	int w = minimap->width * minimap->zoom;
+	int h = minimap->height * minimap->zoom;
+	SDL_Rect dst = {
+		.x = SCREEN_WIDTH - MINIMAP_MARGIN - w,
+		.y = MINIMAP_MARGIN,
+		.w = w,
+		.h = h,
+	};
+	SDL_Rect view = {
+		.x = dst.x + camera->x * minimap->zoom /
+				     (map->tile_w * minimap->step),
+		.y = dst.y + camera->y * minimap->zoom /
+				     (map->tile_h * minimap->step),
+		.w = camera->w * minimap->zoom / (map->tile_w * minimap->step),
+		.h = camera->h * minimap->zoom / (map->tile_h * minimap->step),
+	};
 
-	g_tile_clips[TILE_SKY].x = 0;
-	g_tile_clips[TILE_SKY].y = 160;
-	g_tile_clips[TILE_SKY].w = TILE_WIDTH;
-	g_tile_clips[TILE_SKY].h = TILE_HEIGHT;
+	SDL_RenderCopy(g_renderer, minimap->texture, NULL, &dst);
+	SDL_SetRenderDrawColor(g_renderer, 0xFF, 0xFF, 0xFF, 0xFF);
+	SDL_RenderDrawRect(g_renderer, &view);
+}
 
-	g_tile_clips[TILE_TOPLEFT].x = 80;
-	g_tile_clips[TILE_TOPLEFT].y = 0;
-	g_tile_clips[TILE_TOPLEFT].w = TILE_WIDTH;
-	g_tile_clips[TILE_TOPLEFT].h = TILE_HEIGHT;
+static void minimap_free(struct l_minimap *minimap)
+{
+	free(minimap->pixels);
+	free(minimap->versions);
+	if (minimap->texture)
+		SDL_DestroyTexture(minimap->texture);
+	memset(minimap, 0, sizeof(*minimap));
+}
 
-	g_tile_clips[TILE_LEFT].x = 80;
-	g_tile_clips[TILE_LEFT].y = 80;
-	g_tile_clips[TILE_LEFT].w = TILE_WIDTH;
-	g_tile_clips[TILE_LEFT].h = TILE_HEIGHT;
+// texture of the whole collision layer, computed on the workers. Each
+// texel averages step x step tiles on large maps, and is drawn zoom x zoom
+// pixels on small ones, the minimap being at most MINIMAP_SIZE pixels.
+static int minimap_init(struct l_minimap *minimap, struct l_level *level,
+			struct l_workers *workers)
+{
+	struct l_map *map = level->map;
+	int side = SDL_max(map->width, map->height);
 
-	g_tile_clips[TILE_BOTTOMLEFT].x = 80;
-	g_tile_clips[TILE_BOTTOMLEFT].y = 160;
-	g_tile_clips[TILE_BOTTOMLEFT].w = TILE_WIDTH;
-	g_tile_clips[TILE_BOTTOMLEFT].h = TILE_HEIGHT;
+	memset(minimap, 0, sizeof(*minimap));
+	minimap->level = level;
+	minimap->step = (side + MINIMAP_SIZE - 1) / MINIMAP_SIZE;
+	minimap->zoom = SDL_max(MINIMAP_SIZE / side, 1);
+	minimap->width = (map->width + minimap->step - 1) / minimap->step;
+	minimap->height = (map->height + minimap->step - 1) / minimap->step;
 
-	g_tile_clips[TILE_TOP].x = 160;
-	g_tile_clips[TILE_TOP].y = 0;
-	g_tile_clips[TILE_TOP].w = TILE_WIDTH;
-	g_tile_clips[TILE_TOP].h = TILE_HEIGHT;
+	minimap->pixels = calloc((size_t)minimap->width * minimap->zoom *
+					 minimap->height * minimap->zoom,
+				 sizeof(*minimap->pixels));
+	minimap->versions = malloc(map->layer_chunks *
+				   sizeof(*minimap->versions));
+	if (!minimap->pixels || !minimap->versions) {
+		minimap_free(minimap);
+		return -ENOMEM;
+	}
+	memcpy(minimap->versions, level->tiles_version,
+	       map->layer_chunks * sizeof(*minimap->versions));
 
-	g_tile_clips[TILE_CENTER].x = 160;
-	g_tile_clips[TILE_CENTER].y = 80;
-	g_tile_clips[TILE_CENTER].w = TILE_WIDTH;
-	g_tile_clips[TILE_CENTER].h = TILE_HEIGHT;
+	minimap->texture = SDL_CreateTexture(g_renderer,
+					     SDL_PIXELFORMAT_ARGB8888,
+					     SDL_TEXTUREACCESS_STATIC,
+					     minimap->width * minimap->zoom,
+					     minimap->height * minimap->zoom);
+	if (minimap->texture == NULL) {
+		printf("Unable to create minimap texture! SDL Error: %s\n",
+		       SDL_GetError());
+		minimap_free(minimap);
+		return -ENOMEM;
+	}
+	SDL_SetTextureBlendMode(minimap->texture, SDL_BLENDMODE_BLEND);
+
+	// pixels start transparent, as texels of empty tiles
+	workers_run(workers, minimap_row_job, minimap, minimap->height);
+	SDL_UpdateTexture(minimap->texture, NULL, minimap->pixels,
+			  minimap->width * minimap->zoom *
+				  sizeof(*minimap->pixels));
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////
+// moving object functions
+///////////////////////////////////////////////////////
+
+static void mo_handle_event(struct l_moving_object *mo, SDL_Event e)
+{
+	if (e.type == SDL_KEYDOWN && e.key.repeat == 0) {
+		switch (e.key.keysym.sym) {
+		case SDLK_UP:
+			mo->vel_y -= MO_MAX_VELOCITY;
+			break;
+		case SDLK_DOWN:
+			mo->vel_y += MO_MAX_VELOCITY;
+			break;
+		case SDLK_LEFT:
+			mo->vel_x -= MO_MAX_VELOCITY;
+			break;
+		case SDLK_RIGHT:
+			mo->vel_x += MO_MAX_VELOCITY;
+			break;
+		}
+	} else if (e.type == SDL_KEYUP && e.key.repeat == 0) {
+		switch (e.key.keysym.sym) {
+		case SDLK_UP:
+			mo->vel_y += MO_MAX_VELOCITY;
+			break;
+		case SDLK_DOWN:
+			mo->vel_y -= MO_MAX_VELOCITY;
+			break;
+		case SDLK_LEFT:
+			mo->vel_x += MO_MAX_VELOCITY;
+			break;
+		case SDLK_RIGHT:
+			mo->vel_x -= MO_MAX_VELOCITY;
+			break;
+		}
+	}
+}
+
+static void mo_move(struct l_moving_object *mo, struct l_level *level)
+{
+	// move horizontally, up to the wall or level border on the way
+	mo->pos_x += level_sweep_x(level, &mo->box, mo->vel_x);
+	mo->box.x = mo->pos_x;
+
+	// move vertically, up to the wall or level border on the way
+	mo->pos_y += level_sweep_y(level, &mo->box, mo->vel_y);
+	mo->box.y = mo->pos_y;
+}
+
+// LOD drawing tiles at no less than half their mip size, the one of the
+// smallest mip above the zoom
+static int zoom_lod(float zoom)
+{
+	int lod = 0;
+
+	while (lod < TOTAL_LODS - 1 && zoom * (2 << lod) <= 1)
+		lod++;
+
+	return lod;
+}
+
+// camera area, in level pixels, seen with a zoom
+static void camera_set_zoom(SDL_Rect *camera, float zoom)
+{
+	g_zoom = SDL_clamp(zoom, ZOOM_MIN, ZOOM_MAX);
+	camera->w = SCREEN_WIDTH / g_zoom;
+	camera->h = SCREEN_HEIGHT / g_zoom;
+}
+
+static void camera_handle_event(SDL_Rect *camera, SDL_Event e)
+{
+	if (e.type == SDL_KEYDOWN) {
+		switch (e.key.keysym.sym) {
+		case SDLK_EQUALS:
+		case SDLK_PLUS:
+		case SDLK_KP_PLUS:
+			camera_set_zoom(camera, g_zoom * ZOOM_STEP);
+			break;
+		case SDLK_MINUS:
+		case SDLK_KP_MINUS:
+			camera_set_zoom(camera, g_zoom / ZOOM_STEP);
+			break;
+		}
+	} else if (e.type == SDL_MOUSEWHEEL && e.wheel.y) {
+		camera_set_zoom(camera, e.wheel.y > 0 ? g_zoom * ZOOM_STEP :
+							g_zoom / ZOOM_STEP);
+	}
+}
+
+static void mo_set_camera(struct l_moving_object *mo, struct l_map *map,
+			  SDL_Rect *camera)
+{
+	//Center the camera over the dot
+	camera->x = (mo->box.x + MO_WIDTH / 2) - camera->w / 2;
+	camera->y = (mo->box.y + MO_HEIGHT / 2) - camera->h / 2;
+
+	//Keep the camera in bounds, a level smaller than the zoomed out
+	//camera being in its top left corner
+	if (camera->x > map->width * map->tile_w - camera->w)
+		camera->x = map->width * map->tile_w - camera->w;
+	if (camera->y > map->height * map->tile_h - camera->h)
+		camera->y = map->height * map->tile_h - camera->h;
+	if (camera->x < 0)
+		camera->x = 0;
+	if (camera->y < 0)
+		camera->y = 0;
+}
+
+void mo_render(struct l_moving_object *mo, SDL_Rect *camera)
+{
+	//Show the dot
+	texture_render(&g_mo_texture, mo->box.x - camera->x,
+		       mo->box.y - camera->y, NULL);
+}
+
+///////////////////////////////////////////////////////
+// tile functions
+///////////////////////////////////////////////////////
+
+// clip of a tile type in the tile sheet mip of a LOD
+static inline SDL_Rect tile_clip(int type, int lod)
+{
+	SDL_Rect *clip = &g_tile_clips[type];
+
+	return (SDL_Rect){ clip->x >> lod, clip->y >> lod, clip->w >> lod,
+			   clip->h >> lod };
+}
+
+// tiles of a LOD are drawn in level pixels divided by 1 << lod
+static void tile_render(struct l_map *map, int type, int x, int y,
+			SDL_Rect *camera, int lod)
+{
+	SDL_Rect clip = tile_clip(type, lod);
+
+	// caller only gives tiles that are on the screen
+	texture_render(&g_tiles_textures[lod],
+		       (x * map->tile_w - camera->x) >> lod,
+		       (y * map->tile_h - camera->y) >> lod, &clip);
+}
+
+// draw the tiles of a layer one by one, animated ones being left out when
+// baking
+static void level_render(struct l_level *level, int layer, SDL_Rect *camera,
+			 int animated, int lod)
+{
+	struct l_tile_range range;
+
+	// tiles seen by the camera, deduced from its position and size
+	if (!map_tile_range(level->map, camera, &range))
+		return;
+
+	for (int row = range.row_min; row <= range.row_max; row++) {
+		for (int col = range.col_min; col <= range.col_max; col++) {
+			int type = level_tile_type(level, layer, col, row);
+
+			// chunk not streamed in yet
+			if (type == TILE_NONE || type == TILE_EMPTY ||
+			    (!animated && g_tile_animated[type]))
+				continue;
+			tile_render(level->map, type, col, row, camera, lod);
+		}
+	}
+}
+
+///////////////////////////////////////////////////////
+// baked chunk functions
+///////////////////////////////////////////////////////
+
+static void bake_cache_free()
+{
+	for (int lod = 0; lod < TOTAL_LODS; lod++) {
+		for (int i = 0; i < BAKE_CACHE_SLOTS; i++) {
+			struct l_baked_chunk *chunk = &g_baked_chunks[lod][i];
+
+			if (chunk->texture)
+				SDL_DestroyTexture(chunk->texture);
+			free(chunk->anims);
+			memset(chunk, 0, sizeof(*chunk));
+		}
+	}
+}
+
+// forget the baked chunks overlapping a map chunk whose tiles changed
+static void bake_cache_invalidate_chunk(struct l_map *map, int id)
+{
+	int index = id % map->layer_chunks;
+	SDL_Rect area = {
+		.x = index % map->chunks_x * MAP_CHUNK_TILES * map->tile_w,
+		.y = index / map->chunks_x * MAP_CHUNK_TILES * map->tile_h,
+		.w = MAP_CHUNK_TILES * map->tile_w,
+		.h = MAP_CHUNK_TILES * map->tile_h,
+	};
+
+	for (int lod = 0; lod < TOTAL_LODS; lod++) {
+		for (int i = 0; i < BAKE_CACHE_SLOTS; i++) {
+			struct l_baked_chunk *chunk = &g_baked_chunks[lod][i];
+			SDL_Rect baked = {
+				.x = chunk->cx * (BAKE_CHUNK_SIZE << lod),
+				.y = chunk->cy * (BAKE_CHUNK_SIZE << lod),
+				.w = BAKE_CHUNK_SIZE << lod,
+				.h = BAKE_CHUNK_SIZE << lod,
+			};
+
+			if (chunk->last_used &&
+			    chunk->layer == id / map->layer_chunks &&
+			    SDL_HasIntersection(&area, &baked))
+				chunk->last_used = 0;
+		}
+	}
+}
+
+// forget baked content, e.g. when the renderer lost its render targets
+static void bake_cache_invalidate()
+{
+	for (int lod = 0; lod < TOTAL_LODS; lod++)
+		for (int i = 0; i < BAKE_CACHE_SLOTS; i++)
+			g_baked_chunks[lod][i].last_used = 0;
+}
+
+// remember the animated tiles overlapping a chunk area, its tiles being
+// resident
+static int chunk_find_anims(struct l_baked_chunk *chunk, struct l_level *level,
+			    int layer, SDL_Rect *area)
+{
+	struct l_tile_range range;
+
+	chunk->nb_anims = 0;
+	if (!map_tile_range(level->map, area, &range))
+		return 0;
+
+	for (int row = range.row_min; row <= range.row_max; row++) {
+		for (int col = range.col_min; col <= range.col_max; col++) {
+			int type = level_tile_type(level, layer, col, row);
+
+			if (type == TILE_NONE || !g_tile_animated[type])
+				continue;
+
+			if (chunk->nb_anims == chunk->anims_size) {
+				int size = chunk->anims_size ?
+						   chunk->anims_size * 2 :
+						   16;
+				struct l_anim_tile *anims = realloc(
+					chunk->anims, size * sizeof(*anims));
+
+				if (anims == NULL)
+					return -ENOMEM;
+				chunk->anims = anims;
+				chunk->anims_size = size;
+			}
+			chunk->anims[chunk->nb_anims++] =
+				(struct l_anim_tile){ col, row, type };
+		}
+	}
+	return 0;
+}
+
+// render the tiles of a layer overlapping a chunk into the slot texture. A
+// chunk of a LOD covers BAKE_CHUNK_SIZE << lod level pixels.
+static int chunk_bake(struct l_baked_chunk *chunk, struct l_level *level,
+		      int layer, int cx, int cy, int lod)
+{
+	SDL_Rect area = {
+		.x = cx * (BAKE_CHUNK_SIZE << lod),
+		.y = cy * (BAKE_CHUNK_SIZE << lod),
+		.w = BAKE_CHUNK_SIZE << lod,
+		.h = BAKE_CHUNK_SIZE << lod,
+	};
+
+	if (!chunk->texture) {
+		chunk->texture = SDL_CreateTexture(
+			g_renderer, SDL_PIXELFORMAT_RGBA8888,
+			SDL_TEXTUREACCESS_TARGET, BAKE_CHUNK_SIZE,
+			BAKE_CHUNK_SIZE);
+		if (!chunk->texture) {
+			printf("Unable to create chunk texture! SDL Error: %s\n",
+			       SDL_GetError());
+			return -ENOMEM;
+		}
+		// keep color keyed pixels of the tiles transparent
+		SDL_SetTextureBlendMode(chunk->texture, SDL_BLENDMODE_BLEND);
+	}
+
+	// a baked chunk is kept, it must not miss tiles
+	if (level_require_rect(level, layer, &area) < 0)
+		return -ENOMEM;
+
+	if (SDL_SetRenderTarget(g_renderer, chunk->texture) < 0) {
+		printf("Unable to bake chunk! SDL Error: %s\n", SDL_GetError());
+		return -EINVAL;
+	}
+	SDL_SetRenderDrawColor(g_renderer, 0x00, 0x00, 0x00, 0x00);
+	SDL_RenderClear(g_renderer);
+
+	// chunk area is the camera used to render tiles into the texture, with
+	// a batch of its own as chunks are baked while drawing others
+	level_render_geometry(level, layer, &area, lod >= LOD_STILL_ANIMS, lod,
+			      &g_bake_batch);
+
+	SDL_SetRenderTarget(g_renderer, NULL);
+
+	chunk->nb_anims = 0;
+	if (lod < LOD_STILL_ANIMS &&
+	    chunk_find_anims(chunk, level, layer, &area) < 0)
+		return -ENOMEM;
+
+	chunk->layer = layer;
+	chunk->cx = cx;
+	chunk->cy = cy;
+	chunk->last_used = g_frame;
+
+	return 0;
+}
+
+// get the texture of a chunk, baking it in the least recently used slot if
+// it is not in the cache
+static struct l_baked_chunk *chunk_get(struct l_level *level, int layer,
+				       int cx, int cy, int lod)
+{
+	struct l_baked_chunk *lru = &g_baked_chunks[lod][0];
+
+	for (int i = 0; i < BAKE_CACHE_SLOTS; i++) {
+		struct l_baked_chunk *chunk = &g_baked_chunks[lod][i];
+
+		if (chunk->last_used && chunk->layer == layer &&
+		    chunk->cx == cx && chunk->cy == cy) {
+			chunk->last_used = g_frame;
+			return chunk;
+		}
+		if (chunk->last_used < lru->last_used)
+			lru = chunk;
+	}
+
+	if (chunk_bake(lru, level, layer, cx, cy, lod) < 0)
+		return NULL;
+
+	return lru;
+}
+
+// bake the static layers at load when they fit in the cache
+static void bake_level(struct l_level *level)
+{
+	struct l_map *map = level->map;
+	int chunks_x = (map->width * map->tile_w + BAKE_CHUNK_SIZE - 1) /
+		       BAKE_CHUNK_SIZE;
+	int chunks_y = (map->height * map->tile_h + BAKE_CHUNK_SIZE - 1) /
+		       BAKE_CHUNK_SIZE;
+	int nb_static = 0;
+
+	for (int l = 0; l < map->layer_count; l++)
+		nb_static += !!(map->layers[l].flags & LAYER_STATIC);
+	if (chunks_x * chunks_y * nb_static > BAKE_CACHE_SLOTS)
+		return;
+
+	for (int l = 0; l < map->layer_count; l++) {
+		if (!(map->layers[l].flags & LAYER_STATIC))
+			continue;
+		for (int cy = 0; cy < chunks_y; cy++)
+			for (int cx = 0; cx < chunks_x; cx++)
+				chunk_get(level, l, cx, cy, 0);
+	}
+}
+
+// batch the animated tiles of a baked chunk, to be drawn over it. Tiles
+// overlapping two chunks are drawn twice, whole.
+static void chunk_render_anims(struct l_baked_chunk *chunk, struct l_map *map,
+			       SDL_Rect *camera, int lod)
+{
+	int reserved = tile_batch_reserve(&g_tile_batch, g_tile_batch.nb_tiles +
+								 chunk->nb_anims);
+
+	for (int i = 0; i < chunk->nb_anims; i++) {
+		struct l_anim_tile *a = &chunk->anims[i];
+		SDL_Rect clip = tile_clip(a->type, lod);
+
+		if (reserved < 0)
+			tile_render(map, a->type, a->col, a->row, camera, lod);
+		else
+			tile_batch_add(&g_tile_batch, &g_tiles_textures[lod],
+				       (a->col * map->tile_w - camera->x) >> lod,
+				       (a->row * map->tile_h - camera->y) >> lod,
+				       &clip);
+	}
+}
+
+// draw the baked chunks of a layer under the camera, at most a few copies
+// per frame, and their animated tiles with a single geometry call. Chunks
+// are drawn in LOD pixels.
+static void level_render_chunks(struct l_level *level, int layer,
+				SDL_Rect *camera, int lod)
+{
+	struct l_map *map = level->map;
+	int size = BAKE_CHUNK_SIZE << lod;
+	int cx_min = camera->x / size;
+	int cx_max = (SDL_min(camera->x + camera->w, map->width * map->tile_w) -
+		      1) / size;
+	int cy_min = camera->y / size;
+	int cy_max = (SDL_min(camera->y + camera->h,
+			      map->height * map->tile_h) - 1) / size;
+
+	for (int cy = cy_min; cy <= cy_max; cy++) {
+		for (int cx = cx_min; cx <= cx_max; cx++) {
+			struct l_baked_chunk *chunk;
+			SDL_Rect render_quad = {
+				.x = (cx * size - camera->x) >> lod,
+				.y = (cy * size - camera->y) >> lod,
+				.w = BAKE_CHUNK_SIZE,
+				.h = BAKE_CHUNK_SIZE,
+			};
+
+			chunk = chunk_get(level, layer, cx, cy, lod);
+			if (!chunk) {
+				// no render target, draw tiles one by one
+				g_tile_batch.nb_tiles = 0;
+				level_render(level, layer, camera, 1, lod);
+				return;
+			}
+			SDL_RenderCopy(g_renderer, chunk->texture, NULL,
+				       &render_quad);
+			chunk_render_anims(chunk, map, camera, lod);
+		}
+	}
+
+	tile_batch_flush(&g_tile_batch, &g_tiles_textures[lod]);
+}
+
+///////////////////////////////////////////////////////
+// tile batch functions
+///////////////////////////////////////////////////////
+
+static void tile_batch_free(struct l_tile_batch *batch)
+{
+	free(batch->vertices);
+	free(batch->indices);
+	memset(batch, 0, sizeof(*batch));
+}
+
+// make room for nb_tiles tiles. Indices only depend on the tile position in
+// the batch so they are written once here.
+static int tile_batch_reserve(struct l_tile_batch *batch, int nb_tiles)
+{
+	SDL_Vertex *vertices;
+	int *indices;
+
+	if (nb_tiles <= batch->capacity)
+		return 0;
+
+	vertices = realloc(batch->vertices, nb_tiles * 4 * sizeof(*vertices));
+	if (vertices == NULL)
+		return -ENOMEM;
+	batch->vertices = vertices;
+
+	indices = realloc(batch->indices, nb_tiles * 6 * sizeof(*indices));
+	if (indices == NULL)
+		return -ENOMEM;
+	batch->indices = indices;
+
+	// two triangles per tile quad
+	for (int i = batch->capacity; i < nb_tiles; i++) {
+		indices[i * 6 + 0] = i * 4 + 0;
+		indices[i * 6 + 1] = i * 4 + 1;
+		indices[i * 6 + 2] = i * 4 + 2;
+		indices[i * 6 + 3] = i * 4 + 2;
+		indices[i * 6 + 4] = i * 4 + 3;
+		indices[i * 6 + 5] = i * 4 + 0;
+	}
+	batch->capacity = nb_tiles;
+
+	return 0;
+}
+
+// append a textured quad, clip being given in texture pixels
+static void tile_batch_add(struct l_tile_batch *batch, struct l_texture *t,
+			   int x, int y, SDL_Rect *clip)
+{
+	SDL_Vertex *v = &batch->vertices[batch->nb_tiles * 4];
+	float u0 = (float)clip->x / t->width;
+	float v0 = (float)clip->y / t->height;
+	float u1 = (float)(clip->x + clip->w) / t->width;
+	float v1 = (float)(clip->y + clip->h) / t->height;
+	SDL_Color white = { 0xFF, 0xFF, 0xFF, 0xFF };
+
+	// top left, top right, bottom right, bottom left
+	v[0] = (SDL_Vertex){ { x, y }, white, { u0, v0 } };
+	v[1] = (SDL_Vertex){ { x + clip->w, y }, white, { u1, v0 } };
+	v[2] = (SDL_Vertex){ { x + clip->w, y + clip->h }, white, { u1, v1 } };
+	v[3] = (SDL_Vertex){ { x, y + clip->h }, white, { u0, v1 } };
+
+	batch->nb_tiles++;
+}
+
+// submit the batched tiles in one draw call and empty the batch
+static void tile_batch_flush(struct l_tile_batch *batch, struct l_texture *t)
+{
+	if (batch->nb_tiles)
+		SDL_RenderGeometry(g_renderer, t->texture, batch->vertices,
+				   batch->nb_tiles * 4, batch->indices,
+				   batch->nb_tiles * 6);
+	batch->nb_tiles = 0;
+}
+
+// draw the visible tiles of a layer with a single geometry call, animated
+// ones being left out when baking
+static void level_render_geometry(struct l_level *level, int layer,
+				  SDL_Rect *camera, int animated, int lod,
+				  struct l_tile_batch *batch)
+{
+	struct l_map *map = level->map;
+	struct l_tile_range range;
+	int nb_tiles;
+
+	if (!map_tile_range(map, camera, &range))
+		return;
+
+	nb_tiles = (range.col_max - range.col_min + 1) *
+		   (range.row_max - range.row_min + 1);
+	if (tile_batch_reserve(batch, nb_tiles) < 0) {
+		// not enough memory, draw tiles one by one
+		level_render(level, layer, camera, animated, lod);
+		return;
+	}
+
+	for (int row = range.row_min; row <= range.row_max; row++) {
+		for (int col = range.col_min; col <= range.col_max; col++) {
+			int type = level_tile_type(level, layer, col, row);
+			SDL_Rect clip;
+
+			// chunk not streamed in yet
+			if (type == TILE_NONE || type == TILE_EMPTY ||
+			    (!animated && g_tile_animated[type]))
+				continue;
+			clip = tile_clip(type, lod);
+			tile_batch_add(batch, &g_tiles_textures[lod],
+				       (col * map->tile_w - camera->x) >> lod,
+				       (row * map->tile_h - camera->y) >> lod,
+				       &clip);
+		}
+	}
+
+	tile_batch_flush(batch, &g_tiles_textures[lod]);
+}
+
+// draw the level layers from the bottom one to the top one with the current
+// rendering mode. Only static layers are worth baking, the other ones are
+// drawn from their tiles every frame. Zoomed out, the tiles seen grow with
+// the square of the zoom: every layer is drawn from chunks baked with the
+// tile sheet mip of the LOD, whatever the mode.
+static void level_draw(struct l_level *level, SDL_Rect *camera)
+{
+	struct l_map *map = level->map;
+	int lod = zoom_lod(g_zoom);
+	float scale = g_zoom * (1 << lod);
 
-	g_tile_clips[TILE_BOTTOM].x = 160;
-	g_tile_clips[TILE_BOTTOM].y = 160;
-	g_tile_clips[TILE_BOTTOM].w = TILE_WIDTH;
-	g_tile_clips[TILE_BOTTOM].h = TILE_HEIGHT;
+	// LOD pixels to screen pixels
+	SDL_RenderSetScale(g_renderer, scale, scale);
 
-	g_tile_clips[TILE_TOPRIGHT].x = 240;
-	g_tile_clips[TILE_TOPRIGHT].y = 0;
-	g_tile_clips[TILE_TOPRIGHT].w = TILE_WIDTH;
-	g_tile_clips[TILE_TOPRIGHT].h = TILE_HEIGHT;
+	for (int l = 0; l < map->layer_count; l++) {
+		SDL_Rect layer_cam;
 
-	g_tile_clips[TILE_RIGHT].x = 240;
-	g_tile_clips[TILE_RIGHT].y = 80;
-	g_tile_clips[TILE_RIGHT].w = TILE_WIDTH;
-	g_tile_clips[TILE_RIGHT].h = TILE_HEIGHT;
+		layer_camera(map, l, camera, &layer_cam);
+		if (lod > 0) {
+			level_render_chunks(level, l, &layer_cam, lod);
+			continue;
+		}
+		switch (g_render_mode) {
+		case RENDER_CHUNKS:
+			if (map->layers[l].flags & LAYER_STATIC)
+				level_render_chunks(level, l, &layer_cam, 0);
+			else
+				level_render_geometry(level, l, &layer_cam, 1,
+						      0, &g_tile_batch);
+			break;
+		case RENDER_GEOMETRY:
+			level_render_geometry(level, l, &layer_cam, 1, 0,
+					      &g_tile_batch);
+			break;
+		default:
+			level_render(level, l, &layer_cam, 1, 0);
+			break;
+		}
+	}
 
-	g_tile_clips[TILE_BOTTOMRIGHT].x = 240;
-	g_tile_clips[TILE_BOTTOMRIGHT].y = 160;
-	g_tile_clips[TILE_BOTTOMRIGHT].w = TILE_WIDTH;
-	g_tile_clips[TILE_BOTTOMRIGHT].h = TILE_HEIGHT;
+	SDL_RenderSetScale(g_renderer, 1, 1);
 }
 
 ///////////////////////////////////////////////////////
-// collision detection
+// map hot reload functions
 ///////////////////////////////////////////////////////
 
-static int check_collision(SDL_Rect a, SDL_Rect b)
+// watch the directory of a map file, editors often replace the file instead
+// of writing it
+static int map_watch_init(struct l_map_watch *watch, char *path)
 {
-	// sides of the rectangles
-	int up_a, down_a, left_a, right_a;
-	int up_b, down_b, left_b, right_b;
+	char *slash = strrchr(path, '/');
+	char dir[slash ? slash - path + 2 : 2];
 
-	// sides of rect A
-	left_a = a.x;
-	right_a = a.x + a.w;
-	up_a = a.y;
-	down_a = a.y + a.h;
+	watch->name = slash ? slash + 1 : path;
+	snprintf(dir, sizeof(dir), "%s", slash ? path : ".");
 
-	// sides of rect A
-	left_b = b.x;
-	right_b = b.x + b.w;
-	up_b = b.y;
-	down_b = b.y + b.h;
+	watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (watch->fd < 0) {
+		printf("Failed to init inotify: %s\n", strerror(errno));
+		return -errno;
+	}
 
-	if (left_a >= right_b || right_a <= left_b || up_a >= down_b ||
-	    down_a <= up_b)
-		return 0;
-	else
-		return 1;
+	if (inotify_add_watch(watch->fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) <
+	    0) {
+		int ret = -errno;
+
+		printf("Failed to watch %s: %s\n", dir, strerror(errno));
+		close(watch->fd);
+		watch->fd = -1;
+		return ret;
+	}
+
+	return 0;
 }
 
-static int check_wall_touched(SDL_Rect *box, struct l_tile *tiles, int nb_tiles)
+// non zero if the map file was written since the last call, never blocks
+static int map_watch_changed(struct l_map_watch *watch)
 {
-	// go through tiles
-	for (int i = 0; i < nb_tiles; i++) {
-		// check tile is of wall type
-		if (tiles[i].type >= TILE_CENTER &&
-		    tiles[i].type <= TILE_TOPLEFT) {
-			// collision with the wall ?
-			if (check_collision(*box, tiles[i].box))
-				return 1;
+	char buf[4096]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	int changed = 0;
+	ssize_t len;
+
+	if (watch->fd < 0)
+		return 0;
+
+	while ((len = read(watch->fd, buf, sizeof(buf))) > 0) {
+		for (char *p = buf; p < buf + len;) {
+			struct inotify_event *event = (struct inotify_event *)p;
+
+			if (event->len && !strcmp(event->name, watch->name))
+				changed = 1;
+			p += sizeof(*event) + event->len;
 		}
 	}
-	return 0;
+
+	return changed;
 }
 
-///////////////////////////////////////////////////////
-// moving object functions
-///////////////////////////////////////////////////////
+static void map_watch_free(struct l_map_watch *watch)
+{
+	if (watch->fd >= 0)
+		close(watch->fd);
+	watch->fd = -1;
+}
 
-static void mo_handle_event(struct l_moving_object *mo, SDL_Event e)
+static int map_size_changed(struct l_map *map, struct l_map *new_map,
+			    char *path)
 {
-	if (e.type == SDL_KEYDOWN && e.key.repeat == 0) {
-		switch (e.key.keysym.sym) {
-		case SDLK_UP:
-			mo->vel_y -= MO_MAX_VELOCITY;
-			break;
-		case SDLK_DOWN:
-			mo->vel_y += MO_MAX_VELOCITY;
-			break;
-		case SDLK_LEFT:
-			mo->vel_x -= MO_MAX_VELOCITY;
-			break;
-		case SDLK_RIGHT:
-			mo->vel_x += MO_MAX_VELOCITY;
-			break;
+	if (new_map->width == map->width && new_map->height == map->height &&
+	    new_map->layer_count == map->layer_count &&
+	    new_map->tile_w == map->tile_w && new_map->tile_h == map->tile_h)
+		return 0;
+
+	printf("Map %s changed size, restart to load it\n", path);
+	return 1;
+}
+
+// give new tiles to a resident chunk, rebuilding its walls and baked textures
+// if they changed. Returns 1 if they did.
+static int level_reload_chunk(struct l_level *level, int id,
+			      uint8_t *new_types)
+{
+	struct l_map *map = level->map;
+	uint8_t *types = chunk_types(map, id);
+
+	if (!memcmp(types, new_types, MAP_CHUNK_SIZE))
+		return 0;
+
+	memcpy(types, new_types, MAP_CHUNK_SIZE);
+	chunk_scan(map, level->walls, id);
+	level_chunk_check(level, id, 0);
+
+	return 1;
+}
+
+// Apply the changes of a binary map file to the level, whether the file was
+// replaced or written in place. Only resident chunks are compared with the
+// new file, their tiles being in pages of their own. The other chunks are
+// mapped from the new file again and marked stale, to be read again once
+// resident, so a reload does not read the whole map.
+static int level_reload_binary(struct l_level *level, char *path)
+{
+	struct l_map *map = level->map;
+	struct l_map new_map = { 0 };
+	uint8_t new_types[MAP_CHUNK_SIZE];
+	int nb_chunks = map->layer_chunks * map->layer_count;
+	int changed = 0, stale = 0;
+	int fd, ret;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		printf("Failed to open map file %s: %s\n", path,
+		       strerror(errno));
+		return -errno;
+	}
+
+	// a half written file fails to load, the end of the write triggers
+	// another reload
+	ret = map_read_header(fd, path, &new_map);
+	if (ret < 0 || map_size_changed(map, &new_map, path)) {
+		close(fd);
+		return ret < 0 ? ret : -EINVAL;
+	}
+
+	SDL_LockMutex(level->lock);
+	level_drain_loaded(level);
+
+	// chunks loaded from now on are read from the new file
+	if (dup2(fd, map->fd) < 0) {
+		ret = -errno;
+		printf("Failed to dup2 map file %s: %s\n", path,
+		       strerror(errno));
+		SDL_UnlockMutex(level->lock);
+		close(fd);
+		return ret;
+	}
+	close(fd);
+
+	for (int first = 0; first < nb_chunks;) {
+		int last = first;
+
+		// the chunk being loaded may come from the old file, the
+		// streaming thread is writing its page
+		if (level->chunk_state[first] != CHUNK_UNLOADED) {
+			if (level->chunk_state[first] == CHUNK_LOADING) {
+				level->chunk_stale[first] = 1;
+				stale++;
+			}
+			first++;
+			continue;
 		}
-	} else if (e.type == SDL_KEYUP && e.key.repeat == 0) {
-		switch (e.key.keysym.sym) {
-		case SDLK_UP:
-			mo->vel_y += MO_MAX_VELOCITY;
-			break;
-		case SDLK_DOWN:
-			mo->vel_y -= MO_MAX_VELOCITY;
-			break;
-		case SDLK_LEFT:
-			mo->vel_x += MO_MAX_VELOCITY;
-			break;
-		case SDLK_RIGHT:
-			mo->vel_x -= MO_MAX_VELOCITY;
+
+		while (last + 1 < nb_chunks &&
+		       level->chunk_state[last + 1] == CHUNK_UNLOADED)
+			last++;
+		chunk_unload(map, first, last);
+		memset(&level->chunk_stale[first], 1, last - first + 1);
+		stale += last - first + 1;
+		first = last + 1;
+	}
+	SDL_UnlockMutex(level->lock);
+
+	for (int i = 0; i < level->nb_resident; i++) {
+		int id = level->resident[i];
+
+		// the file got truncated by another write, which triggers
+		// another reload
+		if (pread(map->fd, new_types, MAP_CHUNK_SIZE,
+			  MAP_DATA_OFFSET + (off_t)id * MAP_CHUNK_SIZE) !=
+		    MAP_CHUNK_SIZE) {
+			printf("Failed to read map file %s\n", path);
+			ret = -EINVAL;
 			break;
 		}
+		changed += level_reload_chunk(level, id, new_types);
 	}
+
+	printf("Map %s reloaded, %d resident chunks changed, %d others read "
+	       "again once resident\n",
+	       path, changed, stale);
+
+	return ret;
 }
 
-static void mo_move(struct l_moving_object *mo, struct l_tile *tiles,
-		    int nb_tiles)
+// apply the changes of the map file to the level. Ascii map tiles are all in
+// memory, they are compared with the new file and only the changed chunks
+// get their tiles, walls and baked textures rebuilt.
+static int level_reload(struct l_level *level, char *path)
 {
-	// move horizontally
-	mo->pos_x += mo->vel_x;
-	mo->box.x = mo->pos_x;
+	struct l_map *map = level->map;
+	struct l_map new_map = { 0 };
+	int nb_chunks = map->layer_chunks * map->layer_count;
+	int changed = 0;
+	int ret;
+
+	if (map->mapping)
+		return level_reload_binary(level, path);
+
+	// a half written file fails to load, the end of the write triggers
+	// another reload
+	ret = map_load(path, &new_map);
+	if (ret < 0)
+		return ret;
 
-	// do not go outside screen
-	if (mo->pos_x < 0 || mo->pos_x + MO_WIDTH > LEVEL_WIDTH ||
-	    check_wall_touched(&mo->box, tiles, nb_tiles)) {
-		mo->pos_x -= mo->vel_x;
-		mo->box.x = mo->pos_x;
+	if (map_size_changed(map, &new_map, path)) {
+		map_free(&new_map);
+		return -EINVAL;
 	}
 
-	// move vertically
-	mo->pos_y += mo->vel_y;
-	mo->box.y = mo->pos_y;
+	for (int id = 0; id < nb_chunks; id++) {
+		uint8_t *new_types = chunk_types(&new_map, id);
+
+		if (!memcmp(chunk_types(map, id), new_types, MAP_CHUNK_SIZE))
+			continue;
 
-	// do not go outside screen
-	if (mo->pos_y < 0 || mo->pos_y + MO_HEIGHT > LEVEL_HEIGHT ||
-	    check_wall_touched(&mo->box, tiles, nb_tiles)) {
-		mo->pos_y -= mo->vel_y;
-		mo->box.y = mo->pos_y;
+		ret = level_require_chunk(level, id);
+		if (ret < 0)
+			break;
+		changed += level_reload_chunk(level, id, new_types);
 	}
+
+	map_free(&new_map);
+	printf("Map %s reloaded, %d chunks changed\n", path, changed);
+
+	return ret;
 }
 
-static void mo_set_camera(struct l_moving_object *mo, SDL_Rect *camera)
+///////////////////////////////////////////////////////
+// benchmark functions
+///////////////////////////////////////////////////////
+
+static double bench_ms(Uint64 start, Uint64 end)
 {
-	//Center the camera over the dot
-	camera->x = (mo->box.x + MO_WIDTH / 2) - SCREEN_WIDTH / 2;
-	camera->y = (mo->box.y + MO_HEIGHT / 2) - SCREEN_HEIGHT / 2;
+	return (double)(end - start) * 1000.0 / SDL_GetPerformanceFrequency();
+}
 
-	//Keep the camera in bounds
-	if (camera->x < 0)
-		camera->x = 0;
-	if (camera->y < 0)
-		camera->y = 0;
-	if (camera->x > LEVEL_WIDTH - camera->w)
-		camera->x = LEVEL_WIDTH - camera->w;
-	if (camera->y > LEVEL_HEIGHT - camera->h)
-		camera->y = LEVEL_HEIGHT - camera->h;
+static int bench_compare(const void *a, const void *b)
+{
+	double da = *(const double *)a, db = *(const double *)b;
+
+	return (da > db) - (da < db);
 }
 
-void mo_render(struct l_moving_object *mo, SDL_Rect *camera)
+// move the camera along the scripted path
+static void bench_camera_move(struct l_map *map, SDL_Rect *camera, int path,
+			      int frame, uint32_t *state, int *dir)
 {
-	//Show the dot
-	texture_render(&g_mo_texture, mo->box.x - camera->x,
-		       mo->box.y - camera->y, NULL);
+	int max_x = SDL_max(map->width * map->tile_w - camera->w, 0);
+	int max_y = SDL_max(map->height * map->tile_h - camera->h, 0);
+
+	if (path == BENCH_PATH_JUMP) {
+		// teleport now and then, worst case for streaming
+		if (frame % BENCH_JUMP_FRAMES == 0) {
+			camera->x = map_rand(state) % (max_x + 1);
+			camera->y = map_rand(state) % (max_y + 1);
+		}
+		return;
+	}
+
+	// sweep the map row after row, going back and forth
+	camera->x += *dir * (int)(BENCH_CAMERA_SPEED / g_zoom);
+	if (camera->x < 0 || camera->x > max_x) {
+		camera->x = SDL_clamp(camera->x, 0, max_x);
+		camera->y += camera->h;
+		if (camera->y > max_y)
+			camera->y = 0;
+		*dir = -*dir;
+	}
 }
 
-///////////////////////////////////////////////////////
-// tile functions
-///////////////////////////////////////////////////////
+static void bench_report(double *times, int frames)
+{
+	printf("%-10s %9s %9s %9s %9s %9s\n", "stage (ms)", "mean", "p50",
+	       "p90", "p99", "max");
+
+	for (int s = 0; s < TOTAL_BENCH_STAGES; s++) {
+		double *t = &times[s * frames];
+		double sum = 0;
+
+		qsort(t, frames, sizeof(*t), bench_compare);
+		for (int i = 0; i < frames; i++)
+			sum += t[i];
+
+		printf("%-10s %9.3f %9.3f %9.3f %9.3f %9.3f\n",
+		       g_bench_stage_names[s], sum / frames,
+		       t[(frames - 1) * 50 / 100], t[(frames - 1) * 90 / 100],
+		       t[(frames - 1) * 99 / 100], t[frames - 1]);
+	}
+}
+
+// toggle the wall bit of a tile, as a reload changing its tile would
+static void bench_toggle_wall(struct l_level *level, int x, int y)
+{
+	struct l_map *map = level->map;
+	int cx = x >> MAP_CHUNK_SHIFT, cy = y >> MAP_CHUNK_SHIFT;
+
+	level->walls[(size_t)y * map->chunks_x + cx] ^= 1ull
+							<< (x & MAP_CHUNK_MASK);
+	level->walls_version[cy * map->chunks_x + cx]++;
+}
 
-static void tile_init(struct l_tile *tile, int x, int y, int tile_type)
+// Time the flow field build, then its incremental update after a wall
+// changed in the field chunk the farthest from the goal, then its update
+// after the goal chunk changed, which resets the whole field
+static void bench_flow_field(struct l_level *level, struct l_workers *workers,
+			     SDL_Rect *camera,
+			     struct l_moving_object *agents)
 {
-	// set collision box
-	tile->box.x = x;
-	tile->box.y = y;
-	tile->box.w = TILE_WIDTH;
-	tile->box.h = TILE_HEIGHT;
+	struct l_map *map = level->map;
+	struct l_flow_field flow;
+	Uint64 t0, t1, t2, t3, t4, t5;
+	SDL_Point goal = {
+		.x = (camera->x + camera->w / 2) / map->tile_w,
+		.y = (camera->y + camera->h / 2) / map->tile_h,
+	};
+	SDL_Point wall;
+	int goal_cx = goal.x >> MAP_CHUNK_SHIFT;
+	int goal_cy = goal.y >> MAP_CHUNK_SHIFT;
+	int far_cx, far_cy;
+	int nb_guided = 0;
+
+	t0 = SDL_GetPerformanceCounter();
+	if (flow_field_init(&flow, level, workers, goal) < 0)
+		return;
+	t1 = SDL_GetPerformanceCounter();
 
-	// set type
-	tile->type = tile_type;
+	// middle of the farthest chunk, which may be cut by the map border
+	far_cx = goal_cx - flow.cx < flow.cx + flow.chunks_w - 1 - goal_cx ?
+			 flow.cx + flow.chunks_w - 1 :
+			 flow.cx;
+	far_cy = goal_cy - flow.cy < flow.cy + flow.chunks_h - 1 - goal_cy ?
+			 flow.cy + flow.chunks_h - 1 :
+			 flow.cy;
+	wall.x = SDL_min(far_cx * MAP_CHUNK_TILES + MAP_CHUNK_TILES / 2,
+			 flow.x + flow.width - 1);
+	wall.y = SDL_min(far_cy * MAP_CHUNK_TILES + MAP_CHUNK_TILES / 2,
+			 flow.y + flow.height - 1);
+	bench_toggle_wall(level, wall.x, wall.y);
+	flow_field_update(&flow);
+	t2 = SDL_GetPerformanceCounter();
+
+	// back to the level walls, not timed
+	bench_toggle_wall(level, wall.x, wall.y);
+	flow_field_update(&flow);
+
+	t3 = SDL_GetPerformanceCounter();
+	level->walls_version[goal_cy * map->chunks_x + goal_cx]++;
+	flow_field_update(&flow);
+	t4 = SDL_GetPerformanceCounter();
+
+	for (int i = 0; i < BENCH_AGENTS; i++) {
+		int x = (camera->x + agents[i].pos_x) / map->tile_w;
+		int y = (camera->y + agents[i].pos_y) / map->tile_h;
+
+		nb_guided += flow_field_direction(&flow, x, y) != FLOW_DIR_NONE;
+	}
+	t5 = SDL_GetPerformanceCounter();
+
+	printf("flow field: %dx%d tiles, built in %.3f ms, wall changed %d chunks from the goal updated in %.3f ms, goal chunk changed (full rebuild) in %.3f ms, %d agents guided in %.3f ms\n",
+	       flow.width, flow.height, bench_ms(t0, t1),
+	       SDL_max(abs(far_cx - goal_cx), abs(far_cy - goal_cy)),
+	       bench_ms(t1, t2), bench_ms(t3, t4), nb_guided,
+	       bench_ms(t4, t5));
+	flow_field_free(&flow);
 }
 
-static void tile_render(struct l_tile *tile, SDL_Rect *camera)
+// fly the camera over the level without frame throttling, timing the
+// collision, pathfinding, raycasting, fog, culling and render stages of every
+// frame
+static int bench_run(struct l_level *level, struct l_workers *workers,
+		     int frames, int path)
 {
-	// show the tile only if it is on the screen
-	if (check_collision(*camera, tile->box))
-		texture_render(&g_tiles_texture, tile->box.x - camera->x,
-			       tile->box.y - camera->y,
-			       &g_tile_clips[tile->type]);
+	struct l_map *map = level->map;
+	struct l_moving_object agents[BENCH_AGENTS];
+	struct l_path_request requests[BENCH_PATH_REQUESTS] = { 0 };
+	struct l_path_service paths;
+	struct l_ray_batch rays = { 0 };
+	struct l_fog fog = { 0 };
+	struct l_minimap minimap = { 0 };
+	SDL_Point eyes[BENCH_AGENTS];
+	Uint64 start;
+	int nb_found = 0, nb_routed = 0;
+	long nb_seen = 0, nb_cast = 0;
+	SDL_Rect camera = {
+		.x = 0, .y = 0, .w = SCREEN_WIDTH, .h = SCREEN_HEIGHT,
+	};
+	struct l_tile_range range;
+	uint32_t state = 1;
+	int dir = 1;
+	double *times;
+
+	times = calloc((size_t)frames * TOTAL_BENCH_STAGES, sizeof(*times));
+	if (times == NULL)
+		return -ENOMEM;
+	camera_set_zoom(&camera, g_zoom);
+	if (path_service_init(&paths, level, workers) < 0 ||
+	    ray_batch_reset(&rays, BENCH_RAYS) < 0 ||
+	    fog_init(&fog, level, workers) < 0) {
+		ray_batch_free(&rays);
+		path_service_free(&paths);
+		free(times);
+		return -ENOMEM;
+	}
+
+	// agents bounce in the camera area
+	for (int i = 0; i < BENCH_AGENTS; i++) {
+		agents[i].box.w = MO_WIDTH / 2;
+		agents[i].box.h = MO_HEIGHT / 2;
+		agents[i].vel_x = (int)(map_rand(&state) % 41) - 20;
+		agents[i].vel_y = (int)(map_rand(&state) % 41) - 20;
+		agents[i].pos_x = map_rand(&state) % SCREEN_WIDTH;
+		agents[i].pos_y = map_rand(&state) % SCREEN_HEIGHT;
+	}
+
+	printf("bench: %dx%d tiles, %d frames, render mode %s, zoom %g (lod %d), path %s, %d workers\n",
+	       map->width, map->height, frames,
+	       g_render_mode_names[g_render_mode], g_zoom, zoom_lod(g_zoom),
+	       g_bench_path_names[path], workers->nb_workers);
+
+	level_stream_update(level, &camera, 0, 0);
+	level_require_camera(level, &camera);
+	bake_level(level);
+
+	bench_flow_field(level, workers, &camera, agents);
+
+	start = SDL_GetPerformanceCounter();
+	if (minimap_init(&minimap, level, workers) == 0)
+		printf("minimap: %dx%d texels of %dx%d tiles, built in %.3f ms\n",
+		       minimap.width, minimap.height, minimap.step,
+		       minimap.step,
+		       bench_ms(start, SDL_GetPerformanceCounter()));
+
+	for (int f = 0; f < frames; f++) {
+		Uint64 t0, t1, t2, t3, t4, t5, t6;
+		int prev_x = camera.x, prev_y = camera.y;
+
+		bench_camera_move(map, &camera, path, f, &state, &dir);
+
+		t0 = SDL_GetPerformanceCounter();
+
+		// collision
+		for (int i = 0; i < BENCH_AGENTS; i++) {
+			struct l_moving_object *a = &agents[i];
+			int dx, dy;
+
+			// keep agents in the camera area
+			a->box.x = camera.x + a->pos_x % camera.w;
+			a->box.y = camera.y + a->pos_y % camera.h;
+			a->box.x = SDL_min(a->box.x, map->width * map->tile_w -
+							     a->box.w);
+			a->box.y = SDL_min(a->box.y, map->height * map->tile_h -
+							     a->box.h);
+
+			dx = level_sweep_x(level, &a->box, a->vel_x);
+			a->box.x += dx;
+			dy = level_sweep_y(level, &a->box, a->vel_y);
+			a->box.y += dy;
+
+			// bounce on walls
+			if (dx != a->vel_x)
+				a->vel_x = -a->vel_x;
+			if (dy != a->vel_y)
+				a->vel_y = -a->vel_y;
+			a->pos_x = a->box.x - camera.x;
+			a->pos_y = a->box.y - camera.y;
+		}
+
+		t1 = SDL_GetPerformanceCounter();
+
+		// pathfinding: some agents are routed to tiles around the camera
+		for (int i = 0; i < BENCH_PATH_REQUESTS; i++) {
+			struct l_moving_object *a =
+				&agents[(f * BENCH_PATH_REQUESTS + i) %
+					BENCH_AGENTS];
+			int goal_x = (camera.x + camera.w / 2) / map->tile_w +
+				     (int)(map_rand(&state) %
+					   (2 * BENCH_PATH_RANGE + 1)) -
+				     BENCH_PATH_RANGE;
+			int goal_y = (camera.y + camera.h / 2) / map->tile_h +
+				     (int)(map_rand(&state) %
+					   (2 * BENCH_PATH_RANGE + 1)) -
+				     BENCH_PATH_RANGE;
+
+			requests[i].start.x = (a->box.x + a->box.w / 2) /
+					      map->tile_w;
+			requests[i].start.y = (a->box.y + a->box.h / 2) /
+					      map->tile_h;
+			requests[i].goal.x = SDL_clamp(goal_x, 0, map->width - 1);
+			requests[i].goal.y = SDL_clamp(goal_y, 0, map->height - 1);
+		}
+		path_service_run(&paths, requests, BENCH_PATH_REQUESTS);
+		for (int i = 0; i < BENCH_PATH_REQUESTS; i++)
+			nb_found += requests[i].status == PATH_FOUND;
+		nb_routed += BENCH_PATH_REQUESTS;
+
+		t2 = SDL_GetPerformanceCounter();
+
+		// raycasting: can agents see each other
+		ray_batch_reset(&rays, BENCH_RAYS);
+		for (int i = 0; i < BENCH_RAYS; i++) {
+			struct l_moving_object *a = &agents[i % BENCH_AGENTS];
+			struct l_moving_object *b =
+				&agents[map_rand(&state) % BENCH_AGENTS];
+
+			ray_batch_add(&rays, a->box.x + a->box.w / 2,
+				      a->box.y + a->box.h / 2,
+				      b->box.x + b->box.w / 2,
+				      b->box.y + b->box.h / 2);
+		}
+		ray_batch_cast(level, workers, &rays);
+		for (int i = 0; i < rays.nb_rays; i++)
+			nb_seen += rays.hit[i] == 1;
+		nb_cast += rays.nb_rays;
+
+		t3 = SDL_GetPerformanceCounter();
+
+		// fog: every agent is an observer
+		for (int i = 0; i < BENCH_AGENTS; i++) {
+			eyes[i].x = agents[i].box.x + agents[i].box.w / 2;
+			eyes[i].y = agents[i].box.y + agents[i].box.h / 2;
+		}
+		fog_update(&fog, eyes, BENCH_AGENTS);
+
+		t4 = SDL_GetPerformanceCounter();
+
+		// culling: chunks to stream and tiles seen by the camera
+		level_stream_update(level, &camera, camera.x - prev_x,
+				    camera.y - prev_y);
+		map_tile_range(map, &camera, &range);
+
+		t5 = SDL_GetPerformanceCounter();
+
+		// render
+		SDL_SetRenderDrawColor(g_renderer, 0xFF, 0xFF, 0xFF, 0xFF);
+		SDL_RenderClear(g_renderer);
+		g_frame++;
+		// a 60 fps clock, for runs to draw the same frames
+		tile_anims_update(f * 1000 / 60);
+		level_draw(level, &camera);
+		SDL_RenderSetScale(g_renderer, g_zoom, g_zoom);
+		fog_render(&fog, &camera);
+		SDL_RenderSetScale(g_renderer, 1, 1);
+		if (minimap.texture)
+			minimap_render(&minimap, &camera);
+		SDL_RenderPresent(g_renderer);
+
+		t6 = SDL_GetPerformanceCounter();
+
+		times[BENCH_STAGE_COLLISION * frames + f] = bench_ms(t0, t1);
+		times[BENCH_STAGE_PATH * frames + f] = bench_ms(t1, t2);
+		times[BENCH_STAGE_RAYS * frames + f] = bench_ms(t2, t3);
+		times[BENCH_STAGE_FOG * frames + f] = bench_ms(t3, t4);
+		times[BENCH_STAGE_CULLING * frames + f] = bench_ms(t4, t5);
+		times[BENCH_STAGE_RENDER * frames + f] = bench_ms(t5, t6);
+		times[BENCH_STAGE_FRAME * frames + f] = bench_ms(t0, t6);
+	}
+
+	bench_report(times, frames);
+	printf("paths: %d found out of %d\n", nb_found, nb_routed);
+	printf("rays: %ld clear out of %ld\n", nb_seen, nb_cast);
+	minimap_free(&minimap);
+	fog_free(&fog);
+	ray_batch_free(&rays);
+	path_service_free(&paths);
+	for (int i = 0; i < BENCH_PATH_REQUESTS; i++)
+		free(requests[i].points);
+	free(times);
+
+	return 0;
 }
 
 ///////////////////////////////////////////////////////
 // main
 ///////////////////////////////////////////////////////
 
-int main()
+static void usage(char *name)
+{
+	printf("usage: %s [-m map_file | -g WxH [-s seed]] [-c binary_map_out]\n"
+	       "       [-r render_mode] [-z zoom] [-b frames [-p path]]\n",
+	       name);
+	printf("  -m: tile map to load, binary or ascii (default %s)\n",
+	       PATH_TO_MAP);
+	printf("  -g: generate a 3 layer map of W by H tiles, rooms joined by corridors,\n"
+	       "      instead of loading one\n");
+	printf("  -s: seed of the generated map, the same on any host (default 1)\n");
+	printf("  -c: convert the loaded map to the binary format and exit\n");
+	printf("  -r: level rendering mode, 'r' key cycles modes (default %s)\n",
+	       g_render_mode_names[g_render_mode]);
+	for (int i = 0; i < TOTAL_RENDER_MODES; i++)
+		printf("      %s\n", g_render_mode_names[i]);
+	printf("  -z: camera zoom from %g to %g, '+' and '-' keys or the mouse wheel change it (default 1)\n",
+	       ZOOM_MIN, ZOOM_MAX);
+	printf("  -b: run a headless benchmark over the given number of frames\n");
+	printf("  -p: benchmark camera path (default %s)\n",
+	       g_bench_path_names[BENCH_PATH_SWEEP]);
+	for (int i = 0; i < TOTAL_BENCH_PATHS; i++)
+		printf("      %s\n", g_bench_path_names[i]);
+}
+
+static int name_to_index(char *name, char **names, int nb_names)
+{
+	for (int i = 0; i < nb_names; i++)
+		if (!strcmp(name, names[i]))
+			return i;
+	return -EINVAL;
+}
+
+int main(int argc, char **argv)
 {
 	int quit = 0;
+	int opt, ret;
 	SDL_Event e;
+	char *map_path = PATH_TO_MAP;
+	char *convert_path = NULL;
+	int gen_width = 0, gen_height = 0;
+	uint32_t seed = 1;
+	int bench_frames = 0;
+	int bench_path = BENCH_PATH_SWEEP;
+	float zoom = 1;
+	struct l_map map = { 0 };
+	struct l_map_watch watch = { .fd = -1 };
+	struct l_level level;
+	struct l_workers workers;
+	struct l_fog fog;
+	struct l_minimap minimap;
 	struct l_moving_object mo = {
 		.pos_x = 0,
 		.pos_y = 0,
@@ -529,14 +5331,131 @@ int main()
 		.x = 0, .y = 0, .w = SCREEN_WIDTH, .h = SCREEN_HEIGHT,
 	};
 
-	struct l_tile *tileset = calloc(TOTAL_TILES, sizeof(struct l_tile));
-	if (tileset == NULL) {
-		printf("Failed to alloc tileset!\n");
-		return -EINVAL;
+	while ((opt = getopt(argc, argv, "m:g:s:c:r:z:b:p:h")) != -1) {
+		switch (opt) {
+		case 'm':
+			map_path = optarg;
+			break;
+		case 'c':
+			convert_path = optarg;
+			break;
+		case 'g':
+			if (sscanf(optarg, "%dx%d", &gen_width, &gen_height) !=
+				    2 ||
+			    gen_width <= 0 || gen_height <= 0) {
+				usage(argv[0]);
+				return -EINVAL;
+			}
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			g_render_mode = name_to_index(optarg, g_render_mode_names,
+						      TOTAL_RENDER_MODES);
+			if (g_render_mode < 0) {
+				usage(argv[0]);
+				return -EINVAL;
+			}
+			break;
+		case 'z':
+			zoom = atof(optarg);
+			if (zoom < ZOOM_MIN || zoom > ZOOM_MAX) {
+				usage(argv[0]);
+				return -EINVAL;
+			}
+			break;
+		case 'b':
+			bench_frames = atoi(optarg);
+			if (bench_frames <= 0) {
+				usage(argv[0]);
+				return -EINVAL;
+			}
+			break;
+		case 'p':
+			bench_path = name_to_index(optarg, g_bench_path_names,
+						   TOTAL_BENCH_PATHS);
+			if (bench_path < 0) {
+				usage(argv[0]);
+				return -EINVAL;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : -EINVAL;
+		}
+	}
+
+	// maps are generated, sight is cast and the benchmark agents find
+	// their way on worker threads
+	ret = workers_init(&workers);
+	if (ret < 0)
+		return ret;
+
+	// load level/tile map file, or generate one
+	if (gen_width)
+		ret = map_generate(&map, &workers, gen_width, gen_height, seed);
+	else
+		ret = map_load(map_path, &map);
+	if (ret < 0) {
+		printf("Failed to load map file!\n");
+		workers_free(&workers);
+		return ret;
+	}
+
+	// map conversion only
+	if (convert_path) {
+		ret = map_save_binary(&map, convert_path);
+		workers_free(&workers);
+		map_free(&map);
+		return ret;
+	}
+
+	ret = level_init(&level, &map);
+	if (ret < 0) {
+		workers_free(&workers);
+		level_free(&level);
+		map_free(&map);
+		return ret;
+	}
+
+	init(bench_frames > 0);
+	load_media(&map);
+
+	camera_set_zoom(&camera, zoom);
+
+	if (bench_frames) {
+		ret = bench_run(&level, &workers, bench_frames, bench_path);
+		workers_free(&workers);
+		leave();
+		level_free(&level);
+		map_free(&map);
+		return ret;
+	}
+
+	ret = fog_init(&fog, &level, &workers);
+	if (ret == 0) {
+		ret = minimap_init(&minimap, &level, &workers);
+		if (ret < 0)
+			fog_free(&fog);
 	}
+	if (ret < 0) {
+		workers_free(&workers);
+		leave();
+		level_free(&level);
+		map_free(&map);
+		return ret;
+	}
+
+	// load the chunks around the starting point before the first frame
+	mo_set_camera(&mo, &map, &camera);
+	level_stream_update(&level, &camera, mo.vel_x, mo.vel_y);
+	level_require_camera(&level, &camera);
+	bake_level(&level);
 
-	init();
-	load_media(tileset, TOTAL_TILES);
+	// generated maps have no file to reload
+	if (!gen_width)
+		map_watch_init(&watch, map_path);
 
 	//While application is running
 	while (!quit) {
@@ -549,22 +5468,60 @@ int main()
 				quit = 1;
 			}
 
+			// cycle level rendering modes
+			if (e.type == SDL_KEYDOWN && e.key.repeat == 0 &&
+			    e.key.keysym.sym == SDLK_r) {
+				g_render_mode = (g_render_mode + 1) %
+						TOTAL_RENDER_MODES;
+				printf("render mode: %s\n",
+				       g_render_mode_names[g_render_mode]);
+			}
+
+			// baked textures content is lost with render targets
+			if (e.type == SDL_RENDER_TARGETS_RESET ||
+			    e.type == SDL_RENDER_DEVICE_RESET)
+				bake_cache_invalidate();
+
 			mo_handle_event(&mo, e);
+			camera_handle_event(&camera, e);
+		}
+
+		// map file edited while running
+		if (map_watch_changed(&watch)) {
+			level_reload(&level, map_path);
+			fog_invalidate(&fog);
 		}
 
-		mo_move(&mo, tileset, TOTAL_TILES);
-		mo_set_camera(&mo, &camera);
+		mo_move(&mo, &level);
+		mo_set_camera(&mo, &map, &camera);
+		level_stream_update(&level, &camera, mo.vel_x, mo.vel_y);
+		// chunks changed by a reload while not resident show up once
+		// streamed in
+		minimap_update(&minimap);
+
+		// the character sees from its center
+		SDL_Point eye = { mo.box.x + MO_WIDTH / 2,
+				  mo.box.y + MO_HEIGHT / 2 };
+		fog_update(&fog, &eye, 1);
 
 		// clear screen
 		SDL_SetRenderDrawColor(g_renderer, 0xFF, 0xFF, 0xFF, 0xFF);
 		SDL_RenderClear(g_renderer);
 
 		// render level
-		for (int i = 0; i < TOTAL_TILES; i++)
-			tile_render(&tileset[i], &camera);
+		g_frame++;
+		tile_anims_update(SDL_GetTicks());
+		level_draw(&level, &camera);
+
+		// fog and character are drawn in level pixels
+		SDL_RenderSetScale(g_renderer, g_zoom, g_zoom);
+		fog_render(&fog, &camera);
 
 		//render character
 		mo_render(&mo, &camera);
+		SDL_RenderSetScale(g_renderer, 1, 1);
+
+		minimap_render(&minimap, &camera);
 
 		//update screen
 		SDL_RenderPresent(g_renderer);
@@ -572,8 +5529,13 @@ int main()
 		SDL_Delay(1000 / 60);
 	}
 
+	map_watch_free(&watch);
+	minimap_free(&minimap);
+	fog_free(&fog);
+	workers_free(&workers);
 	leave();
-	free(tileset);
+	level_free(&level);
+	map_free(&map);
 
 	return 0;
 }
\ No newline at end of file